@@ -183,6 +183,10 @@ function CometClient(host){
 
 				// try parsing message
 				do {
+					// skip the heartbeats, newlines between messages.
+					while(data.charAt(comet.pos) == "\n") {
+						comet.pos++;
+					}
 					// this might only be the first part of our current packet.
 					var msg = cutMessage(data.substr(comet.pos));
 					if(msg.length) try {
@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include "arena.h"
+#include "mem.h"
+
+#define ARENA_ALIGN	8
+
+struct arena_chunk {
+	size_t size;
+	size_t used;
+	struct arena_chunk *next;
+	char data[];
+};
+
+static struct arena_chunk *
+arena_chunk_new(struct arena *a, size_t size) {
+
+	struct arena_chunk *c;
+
+	/* at least twice the last one, so that growing strings stay cheap. */
+	if(size < ARENA_CHUNK_SIZE) {
+		size = ARENA_CHUNK_SIZE;
+	}
+	if(a->head && size < 2 * a->head->size) {
+		size = 2 * a->head->size;
+	}
+	if(!(c = rmalloc_in(MEM_CONNECTIONS, sizeof(struct arena_chunk) + size))) {
+		return NULL;
+	}
+	c->size = size;
+	c->used = 0;
+	c->next = a->head;
+	a->head = c;
+	if(!a->first) {
+		a->first = c;
+	}
+	return c;
+}
+
+/**
+ * Uninitialized memory, until the next arena_reset.
+ */
+void *
+arena_alloc(struct arena *a, size_t size) {
+
+	struct arena_chunk *c = a->head;
+	size_t off;
+
+	off = c ? (c->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : 0;
+	if(!c || off + size > c->size) {
+		if(!(c = arena_chunk_new(a, size))) {
+			return NULL;
+		}
+		off = 0;
+	}
+	c->used = off + size;
+
+	a->last = c->data + off;
+	a->last_size = size;
+	return a->last;
+}
+
+/**
+ * Make room for new_size bytes: in place for the last allocation if it
+ * fits, or in a copy otherwise.
+ */
+void *
+arena_grow(struct arena *a, void *ptr, size_t size, size_t new_size) {
+
+	struct arena_chunk *c = a->head;
+	char *p;
+
+	if(ptr && ptr == a->last && (char *)ptr + new_size <= c->data + c->size) {
+		c->used += new_size - a->last_size;
+		a->last_size = new_size;
+		return ptr;
+	}
+	if(!(p = arena_alloc(a, new_size))) {
+		return NULL;
+	}
+	if(ptr) {
+		memcpy(p, ptr, size);
+	}
+	return p;
+}
+
+/**
+ * Forget all allocations, keeping the first chunk only if it is small.
+ */
+void
+arena_reset(struct arena *a) {
+
+	struct arena_chunk *c, *next;
+
+	if(a->first && a->first->size > ARENA_CHUNK_SIZE) {
+		arena_free(a);
+		return;
+	}
+	for(c = a->head; c && c != a->first; c = next) {
+		next = c->next;
+		rfree(c);
+	}
+	if((a->head = a->first)) {
+		a->first->used = 0;
+		a->first->next = NULL;
+	}
+	a->last = NULL;
+	a->last_size = 0;
+}
+
+void
+arena_free(struct arena *a) {
+
+	struct arena_chunk *c, *next;
+
+	for(c = a->head; c; c = next) {
+		next = c->next;
+		rfree(c);
+	}
+	memset(a, 0, sizeof(*a));
+}
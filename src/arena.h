@@ -0,0 +1,36 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+/*
+ * Bump allocator for data that lives as long as an HTTP request: it is
+ * all given back at once by arena_reset. The first chunk is kept for the
+ * next request, larger requests get more chunks.
+ */
+
+#define ARENA_CHUNK_SIZE	1024
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *head;	/* being filled, older ones follow */
+	struct arena_chunk *first;	/* kept across resets */
+
+	char *last;			/* last allocation, which can grow */
+	size_t last_size;
+};
+
+void *
+arena_alloc(struct arena *a, size_t size);
+
+void *
+arena_grow(struct arena *a, void *ptr, size_t size, size_t new_size);
+
+void
+arena_reset(struct arena *a);
+
+void
+arena_free(struct arena *a);
+
+#endif /* ARENA_H */
@@ -1,69 +1,272 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <event.h>
 
 #include "channel.h"
 #include "socket.h"
-#include "dict.h"
+#include "channel_table.h"
+#include "journal.h"
 #include "json.h"
 #include "socket.h"
+#include "output.h"
+#include "conf.h"
+#include "slab.h"
 #include "mem.h"
 
-#define LOG_BUFFER_SIZE	20
+/* max number of encodings cached in a message (transports and JSONP callbacks) */
+#define MAX_ENCODINGS	8
 
-#define LOG_CUR(c) (c->log_pos)
-#define LOG_NEXT(pos) ((pos + 1) % LOG_BUFFER_SIZE)
-#define LOG_PREV(pos) ((pos + LOG_BUFFER_SIZE -1) % LOG_BUFFER_SIZE)
+
+/* slots moved per event loop iteration while the channel table resizes */
+#define CHANNEL_REHASH_STEPS	1024
+
+/* max number of messages sent from the journal on catch-up */
+#define CHANNEL_JOURNAL_CATCHUP	65536
+
+/* max number of framed histories per channel (transports and JSONP callbacks) */
+#define CHANNEL_FRAMED_MAX	4
+
+/* room for a frame header, a chunk header and a JSONP callback around a message */
+#define CHANNEL_FRAME_OVERHEAD	32
+
+/**
+ * The history of a channel framed for a transport, built on catch-up:
+ * every message is framed once, and the ones following a sequence number
+ * are sent as one or two slices of its arena.
+ */
+struct channel_framed {
+
+	encode_function efun;
+	char *jsonp;
+	size_t jsonp_len;
+
+	struct history history;
+	unsigned long long last_seq; /* framed up to this message */
+
+	struct channel_framed *next;
+};
+
+/* max number of idle channels freed at once */
+#define CHANNEL_CLEAN_BATCH	1024
 
 /**
- * This is the hash table of all channels.
+ * This is the hash table of all channels owned by the current worker.
  */
-static dict *__channels = NULL;
+static __thread struct channel_table *__channels = NULL;
+static __thread struct event_base *__channels_base = NULL;
+
+/* channels without users, oldest first. */
+static __thread struct channel_list __idle = {NULL, NULL};
+
+/* channels with a history_max_age, expired by the cleanup timer. */
+static __thread struct channel *__aging = NULL;
+
+/* still over max_memory after the last eviction. */
+static __thread int __over_limit = 0;
+
+/* subscribers are added and removed with every long-poll. */
+static __thread struct slab __channel_slab = SLAB_INITIALIZER(sizeof(struct channel), MEM_CHANNELS);
+static __thread struct slab __user_slab = SLAB_INITIALIZER(sizeof(struct channel_user), MEM_CONNECTIONS);
+
+/* finishes a resize of the table when the event loop has nothing to do. */
+static __thread struct event __rehash_ev;
+static __thread int __rehash_armed = 0;
+
+static void
+channel_rehash_later();
+
+static void
+on_channel_rehash(int fd, short event, void *ptr) {
+
+	(void)fd;
+	(void)event;
+	(void)ptr;
+
+	__rehash_armed = 0;
+	channel_table_rehash(__channels, CHANNEL_REHASH_STEPS);
+	channel_rehash_later();
+}
+
+static void
+channel_rehash_later() {
+
+	struct timeval tv = {0, 0};
+
+	if(__rehash_armed || !channel_table_rehash(__channels, 0)) {
+		return;
+	}
+	evtimer_set(&__rehash_ev, on_channel_rehash, NULL);
+	event_base_set(__channels_base, &__rehash_ev);
+	evtimer_add(&__rehash_ev, &tv);
+	__rehash_armed = 1;
+}
 
 void
-channel_init() {
+channel_init(struct event_base *base) {
 	if(NULL == __channels) {
-		__channels = dictCreate(&dictTypeCopyNoneFreeNone, NULL);
+		__channels = channel_table_new();
+		__channels_base = base;
 	}
 }
 
+static void
+channel_list_push(struct channel_list *list, struct channel *channel) {
+
+	channel->idle_list = list;
+	channel->idle_next = NULL;
+	channel->idle_prev = list->tail;
+	if(list->tail) {
+		list->tail->idle_next = channel;
+	} else {
+		list->head = channel;
+	}
+	list->tail = channel;
+}
+
+/**
+ * Idle list: channels enter it when their last user leaves, and are freed
+ * by channel_clean_idle once they have been idle for the grace period.
+ */
+static void
+channel_idle_enter(struct channel *channel) {
+
+	if(channel->idle_list) {
+		return;
+	}
+	channel->idle_since = time(NULL);
+	channel_list_push(&__idle, channel);
+}
+
+static void
+channel_idle_leave(struct channel *channel) {
+
+	struct channel_list *list = channel->idle_list;
+
+	if(!list) {
+		return;
+	}
+	if(channel->idle_prev) {
+		channel->idle_prev->idle_next = channel->idle_next;
+	} else {
+		list->head = channel->idle_next;
+	}
+	if(channel->idle_next) {
+		channel->idle_next->idle_prev = channel->idle_prev;
+	} else {
+		list->tail = channel->idle_prev;
+	}
+	channel->idle_list = NULL;
+	channel->idle_prev = channel->idle_next = NULL;
+}
+
+/**
+ * Keep an idle channel for `delay' more seconds than the grace period.
+ * The ones behind it in the list wait as long, at most.
+ */
+void
+channel_idle_delay(struct channel *channel, int delay) {
+
+	if(channel->idle_list == &__idle) {
+		channel->idle_since = time(NULL) + delay;
+	}
+}
+
+/**
+ * Move dormant channels to the front of the idle list, to be freed next.
+ */
+void
+channel_idle_requeue(struct channel_list *list) {
+
+	struct channel *channel;
+
+	if(!list->head) {
+		return;
+	}
+	for(channel = list->head; channel; channel = channel->idle_next) {
+		channel->idle_list = &__idle;
+		channel->idle_since = 0;
+	}
+	list->tail->idle_next = __idle.head;
+	if(__idle.head) {
+		__idle.head->idle_prev = list->tail;
+	} else {
+		__idle.tail = list->tail;
+	}
+	__idle.head = list->head;
+	list->head = list->tail = NULL;
+}
+
 struct channel *
 channel_new(const char *name) {
 
-	struct channel *channel = rcalloc(1, sizeof(struct channel));
+	struct channel *channel = slab_alloc(&__channel_slab);
+	struct conf_channel *cc;
+	unsigned int depth;
+	size_t max_bytes;
+	int max_age;
 
 	if(NULL == channel) {
 		return NULL;
 	}
 
-	channel->name = rstrdup(name);
+	channel->name_len = strlen(name);
+	channel->name = rmalloc_in(MEM_CHANNELS, channel->name_len + 1);
 	if(NULL == channel->name) {
-		rfree(channel);
+		slab_free(&__channel_slab, channel);
 		return NULL;
 	}
-	channel->name_len = strlen(name);
-
-	channel->log_buffer = rcalloc(LOG_BUFFER_SIZE, sizeof(struct channel_message));
-	if(NULL == channel->log_buffer) {
-		rfree(channel->name);
-		rfree(channel);
-		return NULL;
+	memcpy(channel->name, name, channel->name_len + 1);
+
+	/* per-channel settings */
+	channel->slow_consumer = __cfg ? __cfg->slow_consumer : SLOW_DROP;
+	depth = __cfg ? __cfg->history_size : 0;
+	max_bytes = __cfg ? __cfg->history_bytes : 0;
+	max_age = __cfg ? __cfg->history_max_age : 0;
+	if(__cfg && (cc = conf_channel_find(__cfg, name))) {
+		if(cc->slow_consumer != -1) {
+			channel->slow_consumer = (slow_policy)cc->slow_consumer;
+		}
+		if(cc->history_size != -1) {
+			depth = cc->history_size;
+		}
+		if(cc->history_bytes != -1) {
+			max_bytes = (size_t)cc->history_bytes;
+		}
+		if(cc->history_max_age != -1) {
+			max_age = cc->history_max_age;
+		}
+	}
+	history_init(&channel->history, depth, max_bytes, 1000ULL * max_age);
+	if(max_age > 0) {
+		channel->aging_next = __aging;
+		if(__aging) {
+			__aging->aging_prev = channel;
+		}
+		__aging = channel;
 	}
 
 	/* add channel to a global list of channels */
-	dictAdd(__channels, channel->name, channel, 0);
+	channel_table_add(__channels, channel);
+	channel_rehash_later();
+
+	/* no users yet */
+	channel_idle_enter(channel);
 
 	return channel;
 }
 
 struct channel *
-channel_find(const char *name) {
+channel_find(const char *name, size_t name_len) {
 
-	dictEntry *de;
-	if((de = dictFind(__channels, name))) {
-		return (struct channel*)de->val;
-	}
-	return NULL;
+	return channel_table_find(__channels, name, name_len);
+}
+
+void
+channel_foreach(void (*fun)(struct channel *, void *), void *ptr) {
+
+	channel_table_foreach(__channels, fun, ptr);
 }
 
 /**
@@ -72,32 +275,60 @@ channel_find(const char *name) {
 void
 channel_free(struct channel * p) {
 
-	int i;
 	rfree(p->name);
 
-	/* clear logs */
-	for(i = 0; i < LOG_BUFFER_SIZE; ++i) {
-		rfree(p->log_buffer[i].data);
+	if(p->aging_prev) {
+		p->aging_prev->aging_next = p->aging_next;
+	} else if(__aging == p) {
+		__aging = p->aging_next;
+	}
+	if(p->aging_next) {
+		p->aging_next->aging_prev = p->aging_prev;
 	}
-	rfree(p->log_buffer);
+
+	/* clear logs */
+	channel_history_free(p);
+	journal_index_free(&p->journal);
 
 	/* there are no users to remove */
 
-	rfree(p);
+	slab_free(&__channel_slab, p);
+}
+
+/**
+ * Free the history of a channel, and its framed copies.
+ */
+void
+channel_history_free(struct channel *channel) {
+
+	struct channel_framed *f, *next;
+
+	history_free(&channel->history);
+	for(f = channel->framed; f; f = next) {
+		next = f->next;
+		history_free(&f->history);
+		rfree(f);
+	}
+	channel->framed = NULL;
 }
 
 struct channel_user *
-channel_new_connection(struct connection *cx, int keep_connected, const char *jsonp, write_function wfun) {
+channel_new_connection(struct connection *cx, int keep_connected, const char *jsonp,
+		encode_function efun) {
 
-	struct channel_user *cu = rcalloc(1, sizeof(struct channel_user));
-	cu->wfun = wfun;
+	struct channel_user *cu = slab_alloc(&__user_slab);
+	cu->efun = efun;
 	cu->cx = cx;
 	cu->free_on_remove = 1;
 	cu->keep_connected = keep_connected;
 
 	if(jsonp && *jsonp) {
 		cu->jsonp_len = strlen(jsonp);
-		cu->jsonp = rcalloc(cu->jsonp_len + 1, 1);
+		if(cu->jsonp_len < CHANNEL_JSONP_INLINE) {
+			cu->jsonp = cu->jsonp_inline;
+		} else {
+			cu->jsonp = rcalloc_in(MEM_CONNECTIONS, cu->jsonp_len + 1, 1);
+		}
 		memcpy(cu->jsonp, jsonp, cu->jsonp_len);
 	}
 
@@ -116,166 +347,597 @@ channel_add_connection(struct channel *channel, struct channel_user *cu) {
 	}
 	cu->next = channel->user_list;
 	channel->user_list = cu;
+
+	channel_idle_leave(channel);
 }
 
 void
 channel_del_connection(struct channel *channel, struct channel_user *cu) {
 
-	/* remove from list */
+	/* remove from list, if it was ever added (catch-up can disconnect first) */
 	if(cu->next) {
 		cu->next->prev = cu->prev;
 	}
 	if(cu->prev) {
 		cu->prev->next = cu->next;
-	} else {
-		if(channel->user_list) {
-			channel->user_list = channel->user_list->next;
-		}
-		if(channel->user_list) {
-			channel->user_list->prev = NULL;
-		}
+	} else if(channel->user_list == cu) {
+		channel->user_list = cu->next;
 	}
-	if(channel->user_list == cu) {
-		channel->user_list = NULL;
+	if(!channel->user_list) {
+		channel_idle_enter(channel);
 	}
 	if(cu->free_on_remove) {
-		rfree(cu->jsonp);
-		rfree(cu);
+		if(cu->jsonp != cu->jsonp_inline) {
+			rfree(cu->jsonp);
+		}
+		slab_free(&__user_slab, cu);
 	}
 }
 
-void
-channel_write(struct channel *channel, const char *data, size_t data_len) {
-
-	struct channel_user *cu;
-	struct channel_message *msg;
+/**
+ * Build a message, returned with a reference. It is framed on demand.
+ */
+struct channel_message *
+channel_message_new(struct channel *channel, const char *data, size_t data_len) {
 
-	/* get next pointer to a log message. */
-	msg = &channel->log_buffer[channel->log_pos];
+	struct channel_message *msg = rcalloc_in(MEM_BUFFERS, 1, sizeof(struct channel_message));
 
-	/* use channel sequence number */
+	msg->refcount = 1;
 	msg->seq = ++(channel->seq);
+	msg->time = history_clock();
 
-	rfree(msg->data); /* free old log message */
-
-	/* copy log data */
 	msg->data = json_msg(channel->name, channel->name_len,
 			msg->seq,
 			data, data_len,
 			&msg->data_len);
 
-	/* incr log pointer */
-	channel->log_pos = LOG_NEXT(channel->log_pos);
+	return msg;
+}
 
-	/* push message to connected users */
-	for(cu = channel->user_list; cu; ) {
-		struct channel_user *next = cu->next;
-		/* write message to connected user */
+void
+channel_message_ref(struct channel_message *msg) {
+	msg->refcount++;
+}
 
-		int ret;
-		char *buffer;
-		size_t sz;
+void
+channel_message_unref(struct channel_message *msg) {
 
-		if(cu->jsonp) {
-			buffer = json_wrap(msg->data, msg->data_len, cu->jsonp, cu->jsonp_len, &sz);
-		} else {
-			buffer = msg->data;
-			sz = msg->data_len;
-		}
+	struct channel_encoding *enc, *next;
 
-		ret = cu->wfun(cu->cx, buffer, sz);
-		if(cu->jsonp) {
-			rfree(buffer);
-		}
+	if(!msg || --msg->refcount > 0) {
+		return;
+	}
+	for(enc = msg->encodings; enc; enc = next) {
+		next = enc->next;
+		rfree(enc->data);
+		rfree(enc);
+	}
+	rfree(msg->data);
+	rfree(msg);
+}
+
+static char *
+channel_frame(const char *data, size_t data_len, encode_function efun,
+		const char *jsonp, size_t jsonp_len, size_t *len) {
+
+	char *wrapped, *ret;
+	size_t sz;
 
-		if(!cu->keep_connected) {
-			http_streaming_end(cu->cx);
-			/* printf("calling cx_remove(%p) from %s:%d\n", cu->cx, __FILE__, __LINE__); */
-			cx_remove(cu->cx);
+	if(!jsonp) {
+		return efun(data, data_len, len);
+	}
+
+	wrapped = json_wrap(data, data_len, jsonp, jsonp_len, &sz);
+	ret = efun(wrapped, sz, len);
+	rfree(wrapped);
+
+	return ret;
+}
+
+static char *
+channel_message_frame(struct channel_message *msg, encode_function efun,
+		const char *jsonp, size_t jsonp_len, size_t *len) {
+
+	return channel_frame(msg->data, msg->data_len, efun, jsonp, jsonp_len, len);
+}
+
+/**
+ * Returns the message framed by `efun', wrapped in a JSONP callback if any.
+ * Encodings are built the first time they are needed and kept with the message,
+ * so that fan-out and catch-up only send existing buffers.
+ */
+const char *
+channel_message_encode(struct channel_message *msg, encode_function efun,
+		const char *jsonp, size_t jsonp_len, size_t *len) {
+
+	struct channel_encoding *enc;
+
+	for(enc = msg->encodings; enc; enc = enc->next) {
+		if(enc->efun == efun && enc->jsonp_len == jsonp_len
+			&& (!jsonp_len || memcmp(enc->jsonp, jsonp, jsonp_len) == 0)) {
+			*len = enc->data_len;
+			return enc->data;
 		}
-		cu = next;
 	}
+
+	if(msg->encoding_count == MAX_ENCODINGS) { /* too many callbacks */
+		return NULL;
+	}
+
+	/* the callback name is stored right after the struct. */
+	enc = rcalloc_in(MEM_BUFFERS, 1, sizeof(struct channel_encoding) + jsonp_len + 1);
+	enc->efun = efun;
+	if(jsonp) {
+		enc->jsonp = (char*)(enc + 1);
+		memcpy(enc->jsonp, jsonp, jsonp_len);
+		enc->jsonp_len = jsonp_len;
+	}
+	enc->data = channel_message_frame(msg, efun, jsonp, jsonp_len, &enc->data_len);
+
+	enc->next = msg->encodings;
+	msg->encodings = enc;
+	msg->encoding_count++;
+
+	*len = enc->data_len;
+	return enc->data;
 }
 
-http_action
-channel_catchup_user(struct channel *channel, struct channel_user *cu, unsigned long long seq) {
+/**
+ * Write a message to a single user.
+ */
+static int
+channel_send(struct channel *channel, struct channel_user *cu, struct channel_message *msg) {
+
+	int ret;
+	const char *buffer;
+	char *tmp = NULL;
+	size_t sz;
+
+	/* send the shared encoding directly */
+	buffer = channel_message_encode(msg, cu->efun, cu->jsonp, cu->jsonp_len, &sz);
+	if(buffer) { /* queued by reference if the client is slow */
+		ret = output_write_msg(cu->cx, msg, buffer, sz, channel->slow_consumer);
+	} else { /* not cached, frame it for this user only. */
+		tmp = channel_message_frame(msg, cu->efun, cu->jsonp, cu->jsonp_len, &sz);
+		ret = output_write(cu->cx, tmp, sz);
+		rfree(tmp);
+	}
 
-	struct channel_message *msg;
-	int pos, first, last, ret, sent_data = 0;
-	int success = 1, found = 0;
+	if(ret == (int)sz) {
+		return (int)msg->data_len;
+	}
+	return -1;
+}
 
-	last = LOG_CUR(channel);
-	first = pos = LOG_PREV(last);
+/**
+ * Write several messages to a single user, together.
+ */
+static int
+channel_send_batch(struct channel *channel, struct channel_user *cu,
+		struct channel_message **msgs, unsigned int count) {
 
-	for(;;) {
-		msg = &channel->log_buffer[pos];
+	struct iovec iov[CHANNEL_BATCH_MAX];
+	size_t total = 0;
+	unsigned int i;
 
-		if(last == LOG_PREV(pos) || !msg->seq || msg->seq <= seq) {
-			/* found all we could. */
-			break;
+	if(count == 1) {
+		return channel_send(channel, cu, msgs[0]) < 0 ? -1 : 0;
+	}
+	for(i = 0; i < count; ++i) {
+		iov[i].iov_base = (void*)channel_message_encode(msgs[i], cu->efun,
+				cu->jsonp, cu->jsonp_len, &iov[i].iov_len);
+		if(!iov[i].iov_base) { /* not cached, one at a time then. */
+			for(i = 0; i < count; ++i) {
+				if(channel_send(channel, cu, msgs[i]) < 0) {
+					return -1;
+				}
+			}
+			return 0;
 		}
-		first = pos;
-		pos = LOG_PREV(pos);
-		found = 1;
+		total += iov[i].iov_len;
+	}
+	if(output_write_msgs(cu->cx, msgs, iov, (int)count, channel->slow_consumer) != (int)total) {
+		return -1;
 	}
+	return 0;
+}
 
-	if(!found || (first +1 == last && channel->log_buffer[first].seq <= seq)) {
-		return HTTP_KEEP_CONNECTED;
+void
+channel_write(struct channel *channel, const char *data, size_t data_len) {
+
+	struct iovec iov;
+
+	iov.iov_base = (void*)data;
+	iov.iov_len = data_len;
+
+	channel_write_batch(channel, &iov, 1);
+}
+
+/**
+ * Publish messages in a channel, with a single pass over its users:
+ * each of them gets up to CHANNEL_BATCH_MAX messages in one write.
+ */
+void
+channel_write_batch(struct channel *channel, const struct iovec *data, unsigned int count) {
+
+	struct channel_user *cu;
+	struct channel_message *msgs[CHANNEL_BATCH_MAX];
+	unsigned int i, n;
+
+	for(; count; data += n, count -= n) {
+		n = count < CHANNEL_BATCH_MAX ? count : CHANNEL_BATCH_MAX;
+
+		for(i = 0; i < n; ++i) {
+			msgs[i] = channel_message_new(channel, data[i].iov_base, data[i].iov_len);
+
+			/* keep a copy for catch-up */
+			history_append(&channel->history, msgs[i]->seq, msgs[i]->time,
+					msgs[i]->data, msgs[i]->data_len);
+			journal_append(channel, msgs[i]->seq, msgs[i]->data, msgs[i]->data_len);
+		}
+
+		/* push messages to connected users */
+		for(cu = channel->user_list; cu; ) {
+			struct channel_user *next = cu->next;
+
+			/* write messages to connected user */
+			/* the writer might be one of the users: never remove them from here. */
+			if(channel_send_batch(channel, cu, msgs, n) < 0) {
+				/* broken or too slow */
+				cx_close(cu->cx);
+			} else if(!cu->keep_connected) {
+				http_streaming_end(cu->cx);
+				cx_close(cu->cx);
+			}
+			cu = next;
+		}
+
+		/* the output queues keep their own references */
+		for(i = 0; i < n; ++i) {
+			channel_message_unref(msgs[i]);
+		}
 	}
+}
+
+/**
+ * HTTP streaming clients get the messages as they are, in a single chunk.
+ * iov[1..n] are the messages, iov[0] and iov[n+1] are filled here.
+ */
+static int
+channel_send_chunk(struct channel_user *cu, struct iovec *iov, int n, size_t total) {
 
-	for(pos = first; pos != last; pos = LOG_NEXT(pos)) {
+	char header[16];
 
-		msg = &channel->log_buffer[pos];
+	iov[0].iov_base = header;
+	iov[0].iov_len = sprintf(header, "%X\r\n", (unsigned int)total);
+	iov[n + 1].iov_base = "\r\n";
+	iov[n + 1].iov_len = 2;
 
-		ret = cu->wfun(cu->cx, msg->data, msg->data_len);
-		if(ret != (int)msg->data_len) { /* failed write */
-			success = 0;
+	total += iov[0].iov_len + 2;
+	return output_writev(cu->cx, iov, n + 2) == (int)total ? 0 : -1;
+}
+
+/**
+ * Frame every message for the transport, send them IOV_MAX at a time.
+ */
+static int
+channel_send_framed(struct channel_user *cu, const struct iovec *msgs, unsigned int count) {
+
+	struct iovec *iov;
+	unsigned int i, n, batch = count < IOV_MAX ? count : IOV_MAX;
+	size_t total;
+	int ret = 0;
+
+	iov = rmalloc(batch * sizeof(struct iovec));
+	for(; count && ret == 0; msgs += n, count -= n) {
+		n = count < batch ? count : batch;
+		for(total = 0, i = 0; i < n; ++i) {
+			iov[i].iov_base = channel_frame(msgs[i].iov_base, msgs[i].iov_len,
+					cu->efun, cu->jsonp, cu->jsonp_len, &iov[i].iov_len);
+			total += iov[i].iov_len;
+		}
+		if(output_writev(cu->cx, iov, (int)n) != (int)total) {
+			ret = -1;
+		}
+		for(i = 0; i < n; ++i) {
+			rfree(iov[i].iov_base);
+		}
+	}
+	rfree(iov);
+
+	return ret;
+}
+
+/**
+ * The history of a channel framed for a user's transport, with the messages
+ * published since it was last used. NULL if the channel has too many.
+ */
+static struct history *
+channel_framed(struct channel *channel, struct channel_user *cu) {
+
+	struct history *h = &channel->history;
+	struct history_entry *e;
+	struct channel_framed *f;
+	unsigned int i, n = 0;
+	char *buffer;
+	size_t sz;
+
+	for(f = channel->framed; f; f = f->next, ++n) {
+		if(f->efun == cu->efun && f->jsonp_len == (size_t)cu->jsonp_len
+			&& (!f->jsonp_len || memcmp(f->jsonp, cu->jsonp, f->jsonp_len) == 0)) {
 			break;
-		} else {
-			sent_data = 1;
 		}
 	}
+	if(!f) {
+		if(n == CHANNEL_FRAMED_MAX) {
+			return NULL;
+		}
+		/* the callback name is stored right after the struct. */
+		f = rcalloc_in(MEM_HISTORY, 1, sizeof(struct channel_framed) + cu->jsonp_len + 1);
+		f->efun = cu->efun;
+		if(cu->jsonp) {
+			f->jsonp = (char*)(f + 1);
+			memcpy(f->jsonp, cu->jsonp, cu->jsonp_len);
+			f->jsonp_len = cu->jsonp_len;
+		}
+		history_init(&f->history, h->depth, !h->max_bytes ? 0
+				: h->max_bytes + (size_t)h->depth * (f->jsonp_len + CHANNEL_FRAME_OVERHEAD),
+				h->max_age);
+		f->next = channel->framed;
+		channel->framed = f;
+	}
+
+	for(i = history_after(h, f->last_seq); i < h->count; ++i) {
+		e = history_get(h, i);
+		buffer = channel_frame(h->arena + e->off, e->len,
+				cu->efun, cu->jsonp, cu->jsonp_len, &sz);
+		history_append(&f->history, e->seq, e->time, buffer, sz);
+		rfree(buffer);
+		f->last_seq = e->seq;
+	}
+	history_expire(&f->history, history_clock());
 
-	if(0 == success) {
+	return &f->history;
+}
+
+static http_action
+channel_catchup_end(struct channel_user *cu, int ret) {
+
+	if(ret != 0) { /* failed write */
 		return HTTP_DISCONNECT;
 	}
-	if(sent_data && (!cu->keep_connected)) {
+	if(!cu->keep_connected) {
 		http_streaming_end(cu->cx);
 		return HTTP_DISCONNECT;
 	}
 	return HTTP_KEEP_CONNECTED;
 }
 
-void
+/**
+ * Send the history to a user, starting with the message at position `from'.
+ */
+static http_action
+channel_catchup_from(struct channel *channel, struct channel_user *cu, unsigned int from) {
+
+	struct history *h = &channel->history, *fh;
+	struct history_entry *e;
+	struct iovec *msgs, chunk[4];
+	unsigned int i, count;
+	unsigned long long seq;
+	int ret, n;
+	size_t total = 0;
+
+	if(from == h->count) {
+		return HTTP_KEEP_CONNECTED;
+	}
+	seq = history_get(h, from)->seq;
+
+	if(cu->efun == http_chunk_encode && !cu->jsonp) {
+		/* straight from the arena */
+		n = history_slices(h, from, chunk + 1, &total);
+		ret = channel_send_chunk(cu, chunk, n, total);
+	} else if((fh = channel_framed(channel, cu))
+			&& fh->count && history_get(fh, 0)->seq <= seq) {
+		/* framed already */
+		n = history_slices(fh, history_after(fh, seq - 1), chunk, &total);
+		ret = output_writev(cu->cx, chunk, n) == (int)total ? 0 : -1;
+	} else {
+		count = h->count - from;
+		msgs = rmalloc(count * sizeof(struct iovec));
+		for(i = 0; i < count; ++i) {
+			e = history_get(h, from + i);
+			msgs[i].iov_base = h->arena + e->off;
+			msgs[i].iov_len = e->len;
+		}
+		ret = channel_send_framed(cu, msgs, count);
+		rfree(msgs);
+	}
+
+	return channel_catchup_end(cu, ret);
+}
+
+/**
+ * Send the messages following `seq' from the journal, at most
+ * CHANNEL_JOURNAL_CATCHUP of the latest ones, IOV_MAX at a time.
+ */
+static http_action
+channel_catchup_journal(struct channel *channel, struct channel_user *cu,
+		unsigned long long seq) {
+
+	struct iovec *iov;
+	unsigned long long last = channel->seq;
+	unsigned int i, batch;
+	size_t total;
+	int ret = 0;
+
+	if(last - seq > CHANNEL_JOURNAL_CATCHUP) {
+		seq = last - CHANNEL_JOURNAL_CATCHUP;
+	}
+	batch = last - seq < IOV_MAX - 2 ? (unsigned int)(last - seq) : IOV_MAX - 2;
+
+	/* room for a chunk header and trailer around the messages. */
+	iov = rmalloc((batch + 2) * sizeof(struct iovec));
+	while(seq < last && ret == 0) {
+		for(total = 0, i = 0; i < batch && seq < last; ++i) {
+			size_t sz;
+			const char *data = journal_get(channel, seq + 1, &sz);
+			if(!data) {
+				break;
+			}
+			iov[i + 1].iov_base = (char *)data;
+			iov[i + 1].iov_len = sz;
+			total += sz;
+			seq++;
+		}
+		if(i == 0) {
+			break;
+		} else if(cu->efun == http_chunk_encode && !cu->jsonp) {
+			ret = channel_send_chunk(cu, iov, (int)i, total);
+		} else {
+			ret = channel_send_framed(cu, iov + 1, i);
+		}
+		if(i < batch && seq < last) { /* not in the journal anymore */
+			break;
+		}
+	}
+	rfree(iov);
+
+	return channel_catchup_end(cu, ret);
+}
+
+/**
+ * Catch-up with the messages following `seq', from the journal if
+ * some of them are not in the history anymore.
+ */
+http_action
+channel_catchup_user(struct channel *channel, struct channel_user *cu, unsigned long long seq) {
+
+	struct history *h = &channel->history;
+	unsigned long long first, oldest;
+
+	history_expire(h, history_clock());
+	oldest = h->count ? history_get(h, 0)->seq : channel->seq + 1;
+	if(oldest > seq + 1 && (first = journal_first(channel)) && first < oldest) {
+		return channel_catchup_journal(channel, cu, first > seq + 1 ? first - 1 : seq);
+	}
+	return channel_catchup_from(channel, cu, history_after(h, seq));
+}
+
+/**
+ * Catch-up with the messages published in the last `ms' milliseconds.
+ */
+http_action
+channel_catchup_since(struct channel *channel, struct channel_user *cu, unsigned long long ms) {
+
+	struct history *h = &channel->history;
+	unsigned long long now = history_clock();
+
+	history_expire(h, now);
+	return channel_catchup_from(channel, cu, history_since(h, ms < now ? now - ms : 0));
+}
+
+/**
+ * Free the channels which have been idle for long enough, a batch at a time.
+ * Returns 1 if more are waiting.
+ */
+int
 channel_clean_idle() {
 
-	struct idle_chan {
-		struct channel *channel;
-		struct idle_chan *next;
-	};
-
-	struct idle_chan *dead_list = NULL, *ic;
-
-	dictIterator *di = dictGetIterator(__channels);
-	dictEntry *de;
-	while((de = dictNext(di))) {
-		struct channel *channel = (struct channel*)de->val;
-		if(channel->user_list == NULL) {
-			struct idle_chan *ic = rcalloc(1, sizeof(*ic));
-			ic->channel = channel;
-			ic->next = dead_list;
-			dead_list = ic;
+	struct channel *channel;
+	struct channel_list *dormant;
+	time_t limit = time(NULL) - (__cfg ? __cfg->idle_channel_grace : 0);
+	int count, more = 0;
+
+	for(count = 0; (channel = __idle.head) && channel->idle_since <= limit; ++count) {
+		if(count == CHANNEL_CLEAN_BATCH) {
+			more = 1;
+			break;
+		}
+		channel_idle_leave(channel);
+		if((dormant = journal_dormant(channel))) {
+			/* keep its seq while its messages are on disk,
+			 * they are read from there. */
+			channel_history_free(channel);
+			channel_list_push(dormant, channel);
+			continue;
 		}
+		channel_table_delete(__channels, channel->name, channel->name_len);
+		channel_free(channel);
+	}
+	channel_rehash_later();
+
+	return more;
+}
+
+/**
+ * Free the history of a channel while `*excess' bytes are over max_memory,
+ * taking off what it gave back.
+ */
+static void
+channel_evict_history(struct channel *channel, void *ptr) {
+
+	long *excess = ptr, used;
+
+	if(*excess > 0 && (channel->history.count || channel->framed)) {
+		used = mem_used_here(MEM_HISTORY);
+		channel_history_free(channel);
+		*excess -= used - mem_used_here(MEM_HISTORY);
+	}
+}
+
+/**
+ * Free message histories while memory is over max_memory, starting with
+ * the channels nobody listens to. Runs from the cleanup timer, memory is
+ * added up once per call. Returns 0 if it is still over.
+ */
+int
+channel_evict() {
+
+	struct channel *channel;
+	size_t total;
+	long excess;
+
+	if(!max_memory || (total = mem_total()) <= max_memory) {
+		__over_limit = 0;
+		return 1;
 	}
-	dictReleaseIterator(di);
+	excess = (long)(total - max_memory);
 
-	/* release channels now */
-	for(ic = dead_list; ic;) {
-		struct idle_chan *next = ic->next;
-		dictDelete(__channels, ic->channel->name);
-		channel_free(ic->channel);
-		rfree(ic);
-		ic = next;
+	for(channel = __idle.head; channel && excess > 0; channel = channel->idle_next) {
+		channel_evict_history(channel, &excess);
 	}
+	if(excess > 0) {
+		channel_foreach(channel_evict_history, &excess);
+	}
+	__over_limit = excess > 0;
+	return !__over_limit;
 }
 
+/**
+ * Drop the messages past their max age, so that the histories of quiet
+ * channels don't keep them until the next publication or catch-up.
+ */
+void
+channel_expire() {
+
+	struct channel *channel;
+	struct channel_framed *f;
+	unsigned long long now = history_clock();
+
+	for(channel = __aging; channel; channel = channel->aging_next) {
+		history_expire(&channel->history, now);
+		for(f = channel->framed; f; f = f->next) {
+			history_expire(&f->history, now);
+		}
+	}
+}
+
+/**
+ * Whether the last eviction left memory over max_memory, in O(1) for
+ * every subscription.
+ */
+int
+channel_over_limit() {
+
+	return __over_limit;
+}
@@ -1,9 +1,23 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
+#include <time.h>
+#include <sys/uio.h>
+
 #include "http.h"
+#include "history.h"
+#include "journal.h"
+#include "conf.h"
 
 struct connection;
+struct event_base;
+struct channel_framed;
+
+/* JSONP callbacks up to this length are kept in the channel_user */
+#define CHANNEL_JSONP_INLINE	32
+
+/* messages sent to a user in one write by channel_write_batch */
+#define CHANNEL_BATCH_MAX	64
 
 struct channel_user {
 
@@ -14,19 +28,51 @@ struct channel_user {
 	int free_on_remove;
 	char *jsonp;
 	int jsonp_len;
+	char jsonp_inline[CHANNEL_JSONP_INLINE];
 
-	write_function wfun;
+	encode_function efun;
 
 	struct channel_user *prev;
 	struct channel_user *next;
 };
 
+/**
+ * A message framed for a transport, and optionally wrapped in a JSONP callback.
+ */
+struct channel_encoding {
+
+	encode_function efun;
+	char *jsonp;
+	size_t jsonp_len;
+
+	char *data;
+	size_t data_len;
+
+	struct channel_encoding *next;
+};
+
+/**
+ * Immutable once written, shared by the channel log and all the subscribers.
+ */
 struct channel_message {
 
+	int refcount;
+
 	unsigned long long seq; /* sequence number */
+	unsigned long long time; /* publication, from history_clock() */
 
 	char *data; /* message contents */
 	size_t data_len;
+
+	/* encodings built on first use, sent as-is to every subscriber. */
+	struct channel_encoding *encodings;
+	int encoding_count;
+};
+
+/* channels linked through idle_prev and idle_next */
+struct channel_list {
+	struct channel *head;
+	struct channel *tail;
 };
 
 struct channel {
@@ -37,12 +83,28 @@ struct channel {
 
 	struct channel_user *user_list;
 
-	struct channel_message *log_buffer;
-	int log_pos;
+	struct history history;
+	struct journal_index journal;
+
+	/* the history framed for the transports of its users */
+	struct channel_framed *framed;
+
+	slow_policy slow_consumer;
+
+	/* in the idle list since idle_since while there are no users,
+	 * or in the dormant list of a journal segment. */
+	struct channel_list *idle_list;
+	time_t idle_since;
+	struct channel *idle_prev;
+	struct channel *idle_next;
+
+	/* in the aging list if its messages have a max age. */
+	struct channel *aging_prev;
+	struct channel *aging_next;
 };
 
 void
-channel_init() ;
+channel_init(struct event_base *base);
 
 struct channel *
 channel_new(const char *name);
@@ -50,11 +112,18 @@ channel_new(const char *name);
 void
 channel_free(struct channel *);
 
+void
+channel_history_free(struct channel *channel);
+
 struct channel *
-channel_find(const char *name);
+channel_find(const char *name, size_t name_len);
+
+void
+channel_foreach(void (*fun)(struct channel *, void *), void *ptr);
 
 struct channel_user *
-channel_new_connection(struct connection *cx, int keep_connected, const char *jsonp, write_function wfun);
+channel_new_connection(struct connection *cx, int keep_connected, const char *jsonp,
+		encode_function efun);
 
 void
 channel_add_connection(struct channel *channel, struct channel_user *cu);
@@ -65,11 +134,45 @@ channel_del_connection(struct channel *channel, struct channel_user *cu);
 void
 channel_write(struct channel *channel, const char *data, size_t data_len);
 
+void
+channel_write_batch(struct channel *channel, const struct iovec *data, unsigned int count);
+
+struct channel_message *
+channel_message_new(struct channel *channel, const char *data, size_t data_len);
+
+void
+channel_message_ref(struct channel_message *msg);
+
+void
+channel_message_unref(struct channel_message *msg);
+
+const char *
+channel_message_encode(struct channel_message *msg, encode_function efun,
+		const char *jsonp, size_t jsonp_len, size_t *len);
+
 http_action
 channel_catchup_user(struct channel *channel, struct channel_user *cu, unsigned long long seq);
 
-void
+http_action
+channel_catchup_since(struct channel *channel, struct channel_user *cu, unsigned long long ms);
+
+int
 channel_clean_idle();
 
+int
+channel_evict();
+
+void
+channel_expire();
+
+int
+channel_over_limit();
+
+void
+channel_idle_requeue(struct channel_list *list);
+
+void
+channel_idle_delay(struct channel *channel, int delay);
+
 #endif /* CHANNEL_H */
 
@@ -0,0 +1,276 @@
+#include <string.h>
+
+#include "channel_table.h"
+#include "channel.h"
+#include "mem.h"
+
+#define CHANNEL_TABLE_INITIAL_SIZE	64
+
+/* slots moved from the old table by each operation during a resize */
+#define CHANNEL_TABLE_MIGRATE_STEP	32
+
+/* grow when more than 3/4 of the slots would be used, counting the
+ * entries still waiting in the old table. */
+#define CHANNEL_TABLE_FULL(t) (((uint64_t)(t)->cur.used + (t)->old.used + 1) * 4 \
+		> ((uint64_t)(t)->cur.mask + 1) * 3)
+
+/* shrink when less than 1/8 of the slots are used */
+#define CHANNEL_TABLE_SPARSE(ht) ((ht)->mask + 1 > CHANNEL_TABLE_INITIAL_SIZE \
+		&& (uint64_t)(ht)->used * 8 < (uint64_t)(ht)->mask + 1)
+
+/**
+ * FNV-1a followed by a final mix, so that both the low bits (used here)
+ * and the high bits (used to pick the owning worker) are well spread.
+ */
+uint32_t
+channel_table_hash(const char *name, size_t name_len) {
+
+	uint32_t h = 2166136261U;
+
+	while(name_len--) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static void
+htable_init(struct channel_htable *ht, uint32_t size) {
+
+	ht->slots = rcalloc_in(MEM_CHANNELS, size, sizeof(struct channel_slot));
+	ht->mask = size - 1;
+	ht->used = 0;
+}
+
+static int
+htable_lookup(struct channel_htable *ht, uint32_t hash, const char *name, size_t name_len) {
+
+	uint32_t i = hash & ht->mask, dist = 1;
+	struct channel_slot *s;
+
+	if(!ht->slots) {
+		return -1;
+	}
+
+	/* stop at an empty slot or at an entry closer to its home than we'd be */
+	for(s = &ht->slots[i]; s->dist >= dist; s = &ht->slots[i]) {
+		if(s->hash == hash && s->channel->name_len == name_len
+				&& memcmp(s->channel->name, name, name_len) == 0) {
+			return (int)i;
+		}
+		i = (i + 1) & ht->mask;
+		dist++;
+	}
+
+	return -1;
+}
+
+static void
+htable_insert(struct channel_htable *ht, uint32_t hash, struct channel *channel) {
+
+	struct channel_slot e, tmp, *s;
+	uint32_t i = hash & ht->mask;
+
+	e.hash = hash;
+	e.dist = 1;
+	e.channel = channel;
+
+	for(;; i = (i + 1) & ht->mask, e.dist++) {
+		s = &ht->slots[i];
+		if(!s->dist) {
+			*s = e;
+			break;
+		}
+		if(s->dist < e.dist) { /* take from the rich */
+			tmp = *s;
+			*s = e;
+			e = tmp;
+		}
+	}
+	ht->used++;
+}
+
+/**
+ * Empty a slot, moving the following entries of its cluster one slot back.
+ */
+static void
+htable_remove_at(struct channel_htable *ht, uint32_t i) {
+
+	uint32_t j;
+
+	for(j = (i + 1) & ht->mask; ht->slots[j].dist > 1; i = j, j = (j + 1) & ht->mask) {
+		ht->slots[i] = ht->slots[j];
+		ht->slots[i].dist--;
+	}
+	ht->slots[i].dist = 0;
+	ht->used--;
+}
+
+/**
+ * Move up to `steps' slots from the old table to the current one.
+ * Removing an entry shifts the next ones back, so the position only
+ * advances on empty slots.
+ */
+static void
+channel_table_migrate(struct channel_table *t, uint32_t steps) {
+
+	struct channel_htable *old = &t->old;
+	struct channel_slot *s;
+
+	if(!old->slots) {
+		return;
+	}
+
+	while(steps-- && old->used) {
+		s = &old->slots[t->migrate_pos];
+		if(s->dist) {
+			htable_insert(&t->cur, s->hash, s->channel);
+			htable_remove_at(old, t->migrate_pos);
+		} else {
+			t->migrate_pos = (t->migrate_pos + 1) & old->mask;
+		}
+	}
+
+	if(!old->used) {
+		rfree(old->slots);
+		memset(old, 0, sizeof(*old));
+	}
+}
+
+/**
+ * Start moving the entries to a table of `size' slots.
+ */
+static void
+channel_table_resize(struct channel_table *t, uint32_t size) {
+
+	/* the previous resize should be over by now, finish it anyway. */
+	channel_table_migrate(t, UINT32_MAX);
+
+	t->old = t->cur;
+	t->migrate_pos = 0;
+	htable_init(&t->cur, size);
+}
+
+struct channel_table *
+channel_table_new() {
+
+	struct channel_table *t = rcalloc_in(MEM_CHANNELS, 1, sizeof(struct channel_table));
+
+	htable_init(&t->cur, CHANNEL_TABLE_INITIAL_SIZE);
+	return t;
+}
+
+/**
+ * Free the table, not the channels.
+ */
+void
+channel_table_free(struct channel_table *t) {
+
+	rfree(t->cur.slots);
+	rfree(t->old.slots);
+	rfree(t);
+}
+
+struct channel *
+channel_table_find(struct channel_table *t, const char *name, size_t name_len) {
+
+	uint32_t hash = channel_table_hash(name, name_len);
+	int i;
+
+	channel_table_migrate(t, CHANNEL_TABLE_MIGRATE_STEP);
+
+	if((i = htable_lookup(&t->cur, hash, name, name_len)) != -1) {
+		return t->cur.slots[i].channel;
+	}
+	if((i = htable_lookup(&t->old, hash, name, name_len)) != -1) {
+		return t->old.slots[i].channel;
+	}
+	return NULL;
+}
+
+/**
+ * Add a channel, which must not be in the table already.
+ */
+void
+channel_table_add(struct channel_table *t, struct channel *channel) {
+
+	channel_table_migrate(t, CHANNEL_TABLE_MIGRATE_STEP);
+
+	if(CHANNEL_TABLE_FULL(t)) {
+		channel_table_resize(t, (t->cur.mask + 1) * 2);
+	}
+
+	htable_insert(&t->cur, channel_table_hash(channel->name, channel->name_len), channel);
+}
+
+/**
+ * Remove a channel from the table. Returns -1 if it wasn't there.
+ */
+int
+channel_table_delete(struct channel_table *t, const char *name, size_t name_len) {
+
+	uint32_t hash = channel_table_hash(name, name_len);
+	int i;
+
+	channel_table_migrate(t, CHANNEL_TABLE_MIGRATE_STEP);
+
+	if((i = htable_lookup(&t->cur, hash, name, name_len)) != -1) {
+		htable_remove_at(&t->cur, (uint32_t)i);
+	} else if((i = htable_lookup(&t->old, hash, name, name_len)) != -1) {
+		htable_remove_at(&t->old, (uint32_t)i);
+	} else {
+		return -1;
+	}
+
+	/* give memory back once most channels are gone */
+	if(!t->old.slots && CHANNEL_TABLE_SPARSE(&t->cur)) {
+		channel_table_resize(t, (t->cur.mask + 1) / 2);
+	}
+	return 0;
+}
+
+/**
+ * Move up to `steps' slots of a resize in progress, for callers with
+ * nothing better to do. Returns 1 if the resize isn't over yet.
+ */
+int
+channel_table_rehash(struct channel_table *t, uint32_t steps) {
+
+	channel_table_migrate(t, steps);
+	return t->old.slots != NULL;
+}
+
+size_t
+channel_table_size(struct channel_table *t) {
+
+	return t->cur.used + t->old.used;
+}
+
+/**
+ * Call fun on every channel. The table must not be modified meanwhile.
+ */
+void
+channel_table_foreach(struct channel_table *t,
+		void (*fun)(struct channel *, void *), void *ptr) {
+
+	struct channel_htable *tables[] = {&t->cur, &t->old};
+	uint32_t i, j;
+
+	for(j = 0; j < 2; ++j) {
+		if(!tables[j]->slots) {
+			continue;
+		}
+		for(i = 0; i <= tables[j]->mask; ++i) {
+			if(tables[j]->slots[i].dist) {
+				fun(tables[j]->slots[i].channel, ptr);
+			}
+		}
+	}
+}
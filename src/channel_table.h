@@ -0,0 +1,66 @@
+#ifndef CHANNEL_TABLE_H
+#define CHANNEL_TABLE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct channel;
+
+/**
+ * A slot of the open-addressing table. The hash is kept inline so that
+ * probing only reads the slots, the channel is only read on a match.
+ */
+struct channel_slot {
+	uint32_t hash;
+	uint32_t dist; /* 0 if empty, otherwise 1 + distance to the home slot */
+	struct channel *channel;
+};
+
+struct channel_htable {
+	struct channel_slot *slots;
+	uint32_t mask;
+	uint32_t used;
+};
+
+/**
+ * Robin Hood hash table of channels, keyed by name.
+ *
+ * When it grows or shrinks, the entries are moved from `old' to `cur' a
+ * few slots at a time, on every operation and from channel_table_rehash,
+ * so that no call has to rehash everything.
+ */
+struct channel_table {
+	struct channel_htable cur;
+	struct channel_htable old; /* being emptied if old.slots is set */
+	uint32_t migrate_pos;
+};
+
+uint32_t
+channel_table_hash(const char *name, size_t name_len);
+
+struct channel_table *
+channel_table_new();
+
+void
+channel_table_free(struct channel_table *t);
+
+struct channel *
+channel_table_find(struct channel_table *t, const char *name, size_t name_len);
+
+void
+channel_table_add(struct channel_table *t, struct channel *channel);
+
+int
+channel_table_delete(struct channel_table *t, const char *name, size_t name_len);
+
+int
+channel_table_rehash(struct channel_table *t, uint32_t steps);
+
+size_t
+channel_table_size(struct channel_table *t);
+
+void
+channel_table_foreach(struct channel_table *t,
+		void (*fun)(struct channel *, void *), void *ptr);
+
+#endif /* CHANNEL_TABLE_H */
@@ -1,10 +1,74 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "conf.h"
 #include "mem.h"
 
+struct conf *__cfg = NULL;
+
+static int
+conf_read_policy(const char *s) {
+
+	while(*s == ' ' || *s == '\t') {
+		s++;
+	}
+	if(strncmp(s, "drop", 4) == 0) {
+		return SLOW_DROP;
+	} else if(strncmp(s, "disconnect", 10) == 0) {
+		return SLOW_DISCONNECT;
+	} else if(strncmp(s, "coalesce", 8) == 0) {
+		return SLOW_COALESCE;
+	}
+	return -1;
+}
+
+/**
+ * Reads "channel <prefix> <setting> <value>"
+ */
+static void
+conf_read_channel(struct conf *conf, const char *line) {
+
+	char prefix[64], key[32];
+	int pos = 0;
+	struct conf_channel *cc;
+
+	if(sscanf(line, "%63s %31s %n", prefix, key, &pos) != 2 || !pos) {
+		return;
+	}
+
+	/* find or create the settings for this prefix */
+	for(cc = conf->channels; cc; cc = cc->next) {
+		if(strcmp(cc->prefix, prefix) == 0) {
+			break;
+		}
+	}
+	if(!cc) {
+		cc = rcalloc(1, sizeof(struct conf_channel));
+		cc->prefix = rstrdup(prefix);
+		cc->prefix_len = strlen(prefix);
+		cc->slow_consumer = -1;
+		cc->history_size = -1;
+		cc->history_bytes = -1;
+		cc->history_max_age = -1;
+		cc->next = conf->channels;
+		conf->channels = cc;
+	}
+
+	if(strcmp(key, "slow_consumer") == 0) {
+		cc->slow_consumer = conf_read_policy(line + pos);
+	} else if(strcmp(key, "history") == 0) { /* depth, and optional size */
+		long bytes = -1; /* not given: same as history_bytes */
+		if(sscanf(line + pos, "%d %ld", &cc->history_size, &bytes) < 1
+				|| cc->history_size < 0) {
+			cc->history_size = -1;
+		}
+		cc->history_bytes = bytes < 0 ? -1 : bytes;
+	} else if(strcmp(key, "history_max_age") == 0) {
+		cc->history_max_age = atoi(line + pos);
+	}
+}
 
 struct conf *
 conf_read(const char *filename) {
@@ -19,6 +83,20 @@ conf_read(const char *filename) {
 
 	conf = rcalloc(1, sizeof(struct conf));
 	conf->client_timeout = 30;
+	conf->request_timeout = 10;
+	conf->heartbeat = 30;
+	conf->idle_channel_grace = 1;
+	conf->threads = 1;
+	conf->output_high_watermark = 1024*1024;
+	conf->output_low_watermark = 256*1024;
+	conf->slow_consumer = SLOW_DROP;
+	conf->history_size = 20;
+	conf->history_bytes = 1024*1024;
+	conf->journal_segment_size = 64*1024*1024;
+	conf->journal_segments = 16;
+	conf->journal_sync = 100;
+	conf->snapshot_grace = 60;
+	conf->upgrade_subscribers = 1;
 
 	while(!feof(f)) {
 		char buffer[100], *ret;
@@ -36,14 +114,61 @@ conf_read(const char *filename) {
 
 		if(strncmp(ret, "ip ", 3) == 0) {
 			conf->ip = rstrdup(ret + 3);
+		} else if(strncmp(ret, "publish_socket ", 15) == 0) {
+			conf->publish_socket = rstrdup(ret + 15);
+		} else if(strncmp(ret, "publish_port ", 13) == 0) {
+			conf->publish_port = (short)atoi(ret + 13);
 		} else if(strncmp(ret, "port ", 5) == 0) {
 			conf->port = (short)atoi(ret + 5);
 		} else if(strncmp(ret, "log ", 4) == 0) {
 			conf->log_file = rstrdup(ret + 4);
 		} else if(strncmp(ret, "client_timeout", 14) == 0) {
 			conf->client_timeout = (int)atoi(ret + 14);
+		} else if(strncmp(ret, "request_timeout", 15) == 0) {
+			conf->request_timeout = (int)atoi(ret + 15);
+		} else if(strncmp(ret, "heartbeat", 9) == 0) {
+			conf->heartbeat = (int)atoi(ret + 9);
+		} else if(strncmp(ret, "idle_channel_grace", 18) == 0) {
+			conf->idle_channel_grace = (int)atoi(ret + 18);
 		} else if(strncmp(ret, "max_connections", 15) == 0) {
 			conf->max_connections = (int)atoi(ret + 15);
+		} else if(strncmp(ret, "max_memory", 10) == 0) {
+			conf->max_memory = (size_t)atol(ret + 10);
+		} else if(strncmp(ret, "threads", 7) == 0) {
+			conf->threads = (int)atoi(ret + 7);
+		} else if(strncmp(ret, "output_high_watermark", 21) == 0) {
+			conf->output_high_watermark = (int)atoi(ret + 21);
+		} else if(strncmp(ret, "output_low_watermark", 20) == 0) {
+			conf->output_low_watermark = (int)atoi(ret + 20);
+		} else if(strncmp(ret, "slow_consumer", 13) == 0) {
+			int policy = conf_read_policy(ret + 13);
+			if(policy != -1) {
+				conf->slow_consumer = (slow_policy)policy;
+			}
+		} else if(strncmp(ret, "history_size", 12) == 0) {
+			conf->history_size = (int)atoi(ret + 12);
+		} else if(strncmp(ret, "history_bytes", 13) == 0) {
+			conf->history_bytes = (size_t)atol(ret + 13);
+		} else if(strncmp(ret, "history_max_age", 15) == 0) {
+			conf->history_max_age = (int)atoi(ret + 15);
+		} else if(strncmp(ret, "journal ", 8) == 0) {
+			conf->journal_dir = rstrdup(ret + 8);
+		} else if(strncmp(ret, "journal_segment_size", 20) == 0) {
+			conf->journal_segment_size = (size_t)atol(ret + 20);
+		} else if(strncmp(ret, "journal_segments", 16) == 0) {
+			conf->journal_segments = (int)atoi(ret + 16);
+		} else if(strncmp(ret, "journal_sync", 12) == 0) {
+			conf->journal_sync = (int)atoi(ret + 12);
+		} else if(strncmp(ret, "snapshot ", 9) == 0) {
+			conf->snapshot = rstrdup(ret + 9);
+		} else if(strncmp(ret, "snapshot_grace", 14) == 0) {
+			conf->snapshot_grace = (int)atoi(ret + 14);
+		} else if(strncmp(ret, "upgrade_socket ", 15) == 0) {
+			conf->upgrade_socket = rstrdup(ret + 15);
+		} else if(strncmp(ret, "upgrade_subscribers", 19) == 0) {
+			conf->upgrade_subscribers = (int)atoi(ret + 19);
+		} else if(strncmp(ret, "channel ", 8) == 0) {
+			conf_read_channel(conf, ret + 8);
 		}
 	}
 	fclose(f);
@@ -52,6 +177,15 @@ conf_read(const char *filename) {
 	if(!conf->ip) {
 		conf->ip = rstrdup("127.0.0.1");
 	}
+	if(conf->threads <= 0) { /* one event loop per core */
+		conf->threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(conf->history_size < 0) {
+		conf->history_size = 0;
+	}
+	if(conf->output_low_watermark > conf->output_high_watermark) {
+		conf->output_low_watermark = conf->output_high_watermark;
+	}
 	if(!conf->log_file) {
 		conf->log_file = rstrdup("river.conf");
 	}
@@ -62,8 +196,37 @@ conf_read(const char *filename) {
 void
 conf_free(struct conf *conf) {
 
+	struct conf_channel *cc, *next;
+
 	rfree(conf->ip);
+	rfree(conf->publish_socket);
 	rfree(conf->log_file);
+	rfree(conf->journal_dir);
+	rfree(conf->snapshot);
+	rfree(conf->upgrade_socket);
+
+	for(cc = conf->channels; cc; cc = next) {
+		next = cc->next;
+		rfree(cc->prefix);
+		rfree(cc);
+	}
 
 	rfree(conf);
 }
+
+/**
+ * Find the settings for a channel, using the longest matching prefix.
+ */
+struct conf_channel *
+conf_channel_find(struct conf *conf, const char *name) {
+
+	struct conf_channel *cc, *best = NULL;
+
+	for(cc = conf->channels; cc; cc = cc->next) {
+		if(strncmp(name, cc->prefix, cc->prefix_len) == 0
+			&& (!best || cc->prefix_len > best->prefix_len)) {
+			best = cc;
+		}
+	}
+	return best;
+}
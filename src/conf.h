@@ -1,23 +1,92 @@
 #ifndef CONF_H
 #define CONF_H
 
+#include <stdlib.h>
+
+/* what to do with a client which doesn't read its messages fast enough */
+typedef enum {
+	SLOW_DROP = 0,	/* drop the oldest messages */
+	SLOW_DISCONNECT,	/* close the connection */
+	SLOW_COALESCE	/* only keep the latest message */
+} slow_policy;
+
+/* settings for the channels whose name starts with a prefix */
+struct conf_channel {
+	char *prefix;
+	size_t prefix_len;
+
+	int slow_consumer; /* slow_policy, -1 if not set */
+
+	int history_size; /* -1 if not set */
+	long history_bytes; /* -1 if not set, 0 for no limit */
+	int history_max_age; /* -1 if not set */
+
+	struct conf_channel *next;
+};
 
 struct conf {
 
 	char *ip;
 	short port;
 
+	/* binary publish protocol */
+	char *publish_socket;
+	short publish_port;
+
 	char *log_file;
 
 	int client_timeout;
+	int request_timeout; /* seconds to send a request */
+
+	/* seconds between probes of idle subscribers, 0 to disable */
+	int heartbeat;
+
+	/* seconds before a channel without users is freed */
+	int idle_channel_grace;
 
 	int max_connections;
+
+	/* bytes, 0 for no limit: histories are freed, then subscribers refused */
+	size_t max_memory;
+
+	int threads;
+
+	/* output buffering, in bytes */
+	int output_high_watermark;
+	int output_low_watermark;
+	slow_policy slow_consumer;
+
+	/* messages kept per channel for catch-up, and their max total size */
+	int history_size;
+	size_t history_bytes;
+	int history_max_age; /* seconds, 0 to keep them */
+
+	/* durable log of the messages, disabled without a directory */
+	char *journal_dir;
+	size_t journal_segment_size;
+	int journal_segments; /* kept per worker */
+	int journal_sync; /* milliseconds between flushes */
+
+	/* channel state saved on SIGUSR1 and on shutdown */
+	char *snapshot;
+	int snapshot_grace; /* seconds for the restored channels' users to come back */
+
+	/* graceful upgrade: sockets handed to the next server */
+	char *upgrade_socket;
+	int upgrade_subscribers;
+
+	struct conf_channel *channels;
 };
 
+extern struct conf *__cfg;
+
 struct conf *
 conf_read(const char *filename);
 
 void
 conf_free(struct conf *conf);
 
+struct conf_channel *
+conf_channel_find(struct conf *conf, const char *name);
+
 #endif /* CONF_H */
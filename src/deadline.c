@@ -0,0 +1,73 @@
+#include "deadline.h"
+#include "socket.h"
+#include "websocket.h"
+#include "worker.h"
+#include "http.h"
+#include "conf.h"
+
+/*
+ * A single timer per connection, on the timing wheel of its worker:
+ * `request_timeout' seconds to send a whole request, then `client_timeout'
+ * seconds for a subscriber to stay connected.
+ */
+
+static void
+on_request_too_slow(struct wheel_timer *t) {
+
+	struct connection *cx = t->ptr;
+
+	if(!cx->closing) { /* otherwise a reply is being sent */
+		cx_remove(cx);
+	}
+}
+
+static void
+on_client_too_old(struct wheel_timer *t) {
+
+	struct connection *cx = t->ptr;
+
+	if(cx->closing) {
+		return;
+	}
+	if(cx->state == CX_CONNECTED_COMET) {
+		http_streaming_end(cx);
+	} else if(cx->wsc && cx->wsc->version == WS_RFC6455) {
+		ws13_close(cx, WS_CLOSE_GOING_AWAY);
+	}
+	cx_close(cx);
+}
+
+static void
+deadline_set(struct connection *cx, wheel_function fun, int seconds) {
+
+	deadline_stop(cx);
+	if(seconds <= 0) {
+		return;
+	}
+	wheel_timer_init(&cx->deadline, fun, cx);
+	wheel_add(&worker_current()->wheel, &cx->deadline, seconds * 1000UL);
+}
+
+/**
+ * Waiting for a request: from the connection, or the end of the last one.
+ */
+void
+deadline_request(struct connection *cx) {
+
+	deadline_set(cx, on_request_too_slow, __cfg->request_timeout);
+}
+
+/**
+ * The connection subscribed.
+ */
+void
+deadline_client(struct connection *cx) {
+
+	deadline_set(cx, on_client_too_old, __cfg->client_timeout);
+}
+
+void
+deadline_stop(struct connection *cx) {
+
+	wheel_del(&cx->deadline);
+}
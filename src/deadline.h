@@ -0,0 +1,15 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+struct connection;
+
+void
+deadline_request(struct connection *cx);
+
+void
+deadline_client(struct connection *cx);
+
+void
+deadline_stop(struct connection *cx);
+
+#endif /* DEADLINE_H */
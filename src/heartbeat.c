@@ -0,0 +1,67 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "heartbeat.h"
+#include "socket.h"
+#include "websocket.h"
+#include "worker.h"
+#include "http.h"
+#include "conf.h"
+
+/*
+ * Subscribers are probed every `heartbeat' seconds, on the timing wheel
+ * of their worker. A half-open connection shows up at the next beat: it
+ * didn't answer the WebSocket ping, or its output stopped draining.
+ */
+
+static void
+on_heartbeat(struct wheel_timer *t) {
+
+	struct connection *cx = t->ptr;
+	int idle = cx->out.written == cx->heartbeat_written;
+
+	/* nothing left while some is waiting, or no answer to our ping. */
+	if((idle && output_pending(cx)) || (cx->wsc && cx->wsc->ping_pending)) {
+		cx->out.broken = 1; /* don't wait for the queue */
+		cx_remove(cx);
+		return;
+	}
+
+	if(idle && !cx->closing) {
+		if(cx->wsc && cx->wsc->version == WS_RFC6455) {
+			ws13_ping(cx);
+			cx->wsc->ping_pending = 1;
+		} else if(cx->state == CX_CONNECTED_COMET) {
+			/* whitespace between messages */
+			http_streaming_chunk(cx, "\n", 1);
+		}
+		/* hixie-76 has no ping, only the output is watched. */
+	}
+	cx->heartbeat_written = cx->out.written;
+
+	wheel_add(&worker_current()->wheel, t, __cfg->heartbeat * 1000UL);
+}
+
+void
+heartbeat_start(struct connection *cx) {
+
+	if(__cfg->heartbeat <= 0) {
+		return;
+	}
+#ifdef TCP_USER_TIMEOUT
+	{ /* give up on unacknowledged data after two beats, not ~15 minutes */
+		unsigned int ms = __cfg->heartbeat * 2000U;
+		setsockopt(cx->fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms));
+	}
+#endif
+	wheel_timer_init(&cx->heartbeat, on_heartbeat, cx);
+	cx->heartbeat_written = cx->out.written;
+	wheel_add(&worker_current()->wheel, &cx->heartbeat, __cfg->heartbeat * 1000UL);
+}
+
+void
+heartbeat_stop(struct connection *cx) {
+
+	wheel_del(&cx->heartbeat);
+}
@@ -0,0 +1,12 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+struct connection;
+
+void
+heartbeat_start(struct connection *cx);
+
+void
+heartbeat_stop(struct connection *cx);
+
+#endif /* HEARTBEAT_H */
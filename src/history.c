@@ -0,0 +1,285 @@
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "history.h"
+#include "mem.h"
+
+#define HISTORY_MIN_ARENA	1024
+#define HISTORY_MIN_INDEX	8
+
+#define HISTORY_AT(h, i) (&(h)->index[((h)->first + (i)) % (h)->capacity])
+
+/**
+ * Milliseconds from an arbitrary point, never going back.
+ */
+unsigned long long
+history_clock() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Milliseconds since the epoch of a history_clock() time, and back,
+ * for the times written to disk.
+ */
+unsigned long long
+history_to_epoch(unsigned long long time) {
+
+	struct timeval tv;
+	unsigned long long now, clock = history_clock();
+
+	gettimeofday(&tv, NULL);
+	now = (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	return now - (clock > time ? clock - time : 0);
+}
+
+unsigned long long
+history_from_epoch(unsigned long long epoch) {
+
+	unsigned long long age, clock = history_clock();
+
+	age = history_to_epoch(clock);
+	age = age > epoch ? age - epoch : 0;
+	return age < clock ? clock - age : 0;
+}
+
+void
+history_init(struct history *h, unsigned int depth, size_t max_bytes,
+		unsigned long long max_age) {
+
+	memset(h, 0, sizeof(*h));
+	h->depth = depth;
+	h->max_bytes = max_bytes;
+	h->max_age = max_age;
+}
+
+void
+history_free(struct history *h) {
+
+	rfree(h->arena);
+	rfree(h->index);
+	history_init(h, h->depth, h->max_bytes, h->max_age);
+}
+
+/**
+ * i-th message, starting from the oldest.
+ */
+struct history_entry *
+history_get(struct history *h, unsigned int i) {
+
+	return HISTORY_AT(h, i);
+}
+
+static void
+history_drop_oldest(struct history *h) {
+
+	h->first = (h->first + 1) % h->capacity;
+	h->count--;
+}
+
+/**
+ * Move everything to new buffers, oldest message first.
+ */
+static void
+history_grow(struct history *h, size_t size, unsigned int capacity) {
+
+	char *arena = rmalloc_in(MEM_HISTORY, size);
+	struct history_entry *index = rmalloc_in(MEM_HISTORY, capacity * sizeof(struct history_entry));
+	size_t off = 0;
+	unsigned int i;
+
+	for(i = 0; i < h->count; ++i) {
+		struct history_entry *e = HISTORY_AT(h, i);
+
+		memcpy(arena + off, h->arena + e->off, e->len);
+		index[i] = *e;
+		index[i].off = off;
+		off += e->len;
+	}
+
+	rfree(h->arena);
+	rfree(h->index);
+	h->arena = arena;
+	h->size = size;
+	h->index = index;
+	h->capacity = capacity;
+	h->first = 0;
+}
+
+/**
+ * Find room for len bytes in the arena, without dropping any message.
+ * Returns the offset, or -1.
+ */
+static long
+history_room(struct history *h, size_t len) {
+
+	struct history_entry *first, *last;
+	size_t start, tail;
+
+	if(!h->count) {
+		return len <= h->size ? 0 : -1;
+	}
+
+	first = HISTORY_AT(h, 0);
+	last = HISTORY_AT(h, h->count - 1);
+	start = first->off;
+	tail = last->off + last->len;
+
+	if(start < tail) { /* used: [start, tail) */
+		if(tail + len <= h->size) {
+			return (long)tail;
+		}
+		if(len <= start) { /* leave the end unused and start over. */
+			return 0;
+		}
+	} else if(tail + len <= start) { /* used: [start, size) and [0, tail) */
+		return (long)tail;
+	}
+	return -1;
+}
+
+/**
+ * Copy a message at the end of the history, dropping the oldest ones
+ * if there are too many or if they take too much room.
+ */
+void
+history_append(struct history *h, unsigned long long seq, unsigned long long time,
+		const char *data, size_t len) {
+
+	struct history_entry *e;
+	size_t size, used;
+	unsigned int capacity, i;
+	long off;
+
+	if(!h->depth || (h->max_bytes && len > h->max_bytes)) { /* can't keep it, nor the others. */
+		history_free(h);
+		return;
+	}
+
+	history_expire(h, time);
+	if(h->count == h->depth) {
+		history_drop_oldest(h);
+	}
+
+	/* grow the index and arena while the limits allow it. */
+	capacity = h->capacity;
+	if(h->count == capacity) {
+		capacity = capacity ? capacity * 2 : HISTORY_MIN_INDEX;
+		if(capacity > h->depth) {
+			capacity = h->depth;
+		}
+	}
+	size = h->size;
+	if((!h->max_bytes || size < h->max_bytes) && history_room(h, len) == -1) {
+		for(used = len, i = 0; i < h->count; ++i) {
+			used += HISTORY_AT(h, i)->len;
+		}
+		for(size = size ? size : HISTORY_MIN_ARENA; size < 2 * used; size *= 2);
+		if(h->max_bytes && size > h->max_bytes) {
+			size = h->max_bytes;
+		}
+	}
+	if(capacity != h->capacity || size != h->size) {
+		history_grow(h, size, capacity);
+	}
+
+	/* drop old messages until this one fits. */
+	while((off = history_room(h, len)) == -1) {
+		history_drop_oldest(h);
+	}
+
+	e = HISTORY_AT(h, h->count);
+	e->seq = seq;
+	e->time = time;
+	e->off = (size_t)off;
+	e->len = len;
+	memcpy(h->arena + off, data, len);
+	h->count++;
+}
+
+/**
+ * Drop the messages older than max_age, the oldest being at the front.
+ * The buffers go away with the last message.
+ */
+void
+history_expire(struct history *h, unsigned long long now) {
+
+	if(!h->max_age || !h->count) {
+		return;
+	}
+	while(h->count && HISTORY_AT(h, 0)->time + h->max_age < now) {
+		history_drop_oldest(h);
+	}
+	if(!h->count) {
+		history_free(h);
+	}
+}
+
+/**
+ * Position of the first message with a sequence number greater than seq,
+ * h->count if there is none.
+ */
+unsigned int
+history_after(struct history *h, unsigned long long seq) {
+
+	unsigned int lo = 0, hi = h->count, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(HISTORY_AT(h, mid)->seq <= seq) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**
+ * Position of the first message published at `time' or later,
+ * h->count if there is none.
+ */
+unsigned int
+history_since(struct history *h, unsigned long long time) {
+
+	unsigned int lo = 0, hi = h->count, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(HISTORY_AT(h, mid)->time < time) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**
+ * Describe the messages from position `from' to the latest as one or two
+ * slices of the arena. Returns the number of slices.
+ */
+int
+history_slices(struct history *h, unsigned int from, struct iovec *iov, size_t *total) {
+
+	struct history_entry *e, *prev;
+	unsigned int i;
+	int n = 0;
+
+	*total = 0;
+	for(i = from, prev = NULL; i < h->count; prev = e, ++i) {
+		e = HISTORY_AT(h, i);
+		if(!prev || e->off != prev->off + prev->len) { /* new slice */
+			iov[n].iov_base = h->arena + e->off;
+			iov[n].iov_len = 0;
+			n++;
+		}
+		iov[n-1].iov_len += e->len;
+		*total += e->len;
+	}
+	return n;
+}
@@ -0,0 +1,74 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdlib.h>
+#include <sys/uio.h>
+
+/* a message in the arena */
+struct history_entry {
+	unsigned long long seq;
+	unsigned long long time; /* publication, from history_clock() */
+	size_t off;
+	size_t len;
+};
+
+/**
+ * Last messages of a channel, for catch-up.
+ *
+ * The messages are copied back to back in a byte ring (the arena), never
+ * split at its end, so that a run of messages is at most two contiguous
+ * slices. `index' is a ring of the entries, oldest first.
+ * Both grow on demand, up to `depth' messages and `max_bytes' bytes (if set).
+ * Messages older than `max_age' milliseconds (if set) are dropped from the
+ * front whenever the history is used.
+ */
+struct history {
+	unsigned int depth;
+	size_t max_bytes;
+	unsigned long long max_age;
+
+	char *arena;
+	size_t size;
+
+	struct history_entry *index;
+	unsigned int capacity;
+	unsigned int first;
+	unsigned int count;
+};
+
+unsigned long long
+history_clock();
+
+unsigned long long
+history_to_epoch(unsigned long long time);
+
+unsigned long long
+history_from_epoch(unsigned long long epoch);
+
+void
+history_init(struct history *h, unsigned int depth, size_t max_bytes,
+		unsigned long long max_age);
+
+void
+history_free(struct history *h);
+
+void
+history_append(struct history *h, unsigned long long seq, unsigned long long time,
+		const char *data, size_t len);
+
+void
+history_expire(struct history *h, unsigned long long now);
+
+struct history_entry *
+history_get(struct history *h, unsigned int i);
+
+unsigned int
+history_after(struct history *h, unsigned long long seq);
+
+unsigned int
+history_since(struct history *h, unsigned long long time);
+
+int
+history_slices(struct history *h, unsigned int from, struct iovec *iov, size_t *total);
+
+#endif /* HISTORY_H */
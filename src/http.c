@@ -2,9 +2,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "http.h"
 #include "socket.h"
+#include "output.h"
 #include "mem.h"
 
 int
@@ -56,7 +58,7 @@ http_response_ct(struct connection *cx, int code, const char *status, const char
 			(long unsigned int)len);
 	memcpy(buffer + ret, data, len);
 
-	ret = write(cx->fd, buffer, sz);
+	ret = output_write(cx, buffer, sz);
 	rfree(buffer);
 	return ret;
 }
@@ -80,33 +82,51 @@ http_streaming_start_ct(struct connection *cx, int code, const char *status, con
 	buffer = rcalloc(sz + 1, 1);
 	ret = sprintf(buffer, template, code, status, content_type);
 
-	ret = write(cx->fd, buffer, sz);
+	ret = output_write(cx, buffer, sz);
 	rfree(buffer);
 }
 
 int
 http_streaming_chunk(struct connection *cx, const char *data, size_t len) {
 
+	int ret;
+	char header[16];
+	struct iovec iov[3];
+
+	/* chunk header, data, and trailer: no copy. */
+	iov[0].iov_base = header;
+	iov[0].iov_len = sprintf(header, "%X\r\n", (unsigned int)len);
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = len;
+	iov[2].iov_base = "\r\n";
+	iov[2].iov_len = 2;
+
+	ret = output_writev(cx, iov, 3);
+	if(ret == (int)(iov[0].iov_len + len + 2)) { /* success */
+		return (int)len;
+	}
+	return -1; /* failure */
+}
+
+char *
+http_chunk_encode(const char *data, size_t len, size_t *out_len) {
+
 	int ret;
 	size_t sz = hex_length(len) + 2 + len + 2;
-	char *buffer = rcalloc(sz + 1, 1);
+	char *buffer = rmalloc_in(MEM_BUFFERS, sz + 1);
 
 	ret = sprintf(buffer, "%X\r\n", (unsigned int)len);
 	memcpy(buffer + ret, data, len);
 	memcpy(buffer + ret + len, "\r\n", 2);
 
-	ret = write(cx->fd, buffer, sz);
-	rfree(buffer);
-	if(ret == (int)sz) { /* success */
-		return (int)len;
-	}
-	return -1; /* failure */
+	*out_len = sz;
+	return buffer;
 }
 
 void
 http_streaming_end(struct connection *cx) {
 
-	int ret = write(cx->fd, "0\r\n\r\n", 5);
+	int ret = output_write(cx, "0\r\n\r\n", 5);
 	(void)ret;
 }
 
@@ -129,19 +149,25 @@ send_empty_reply(struct connection *cx, int error) {
 		case 403:
 			http_response(cx, 403, "Forbidden", "", 0);
 			break;
+
+		case 503:
+			http_response(cx, 503, "Service Unavailable", "", 0);
+			break;
 	}
 }
 
 
+/* keys are compared on their first bytes, like strncmp */
+#define HTTP_KEY_IS(key, len, s)	((len) >= sizeof(s) - 1 && memcmp((key), (s), sizeof(s) - 1) == 0)
+
 /**
- * Copy the url
+ * Extract parameters from the url or the body, the values are kept
+ * in the arena of the connection.
  */
 static int
-http_parser_split_params(http_parser *parser, const char *at, size_t len, http_step step) {
+http_split_params(struct connection *cx, const char *at, size_t len, http_step step) {
 
-	struct connection *cx = parser->data;
-
-	const char *p;
+	const char *p, *end;
 	switch(step) {
 		case ON_URL:
 			p = strchr(at, '?'); /* GET: start after page name */
@@ -165,64 +191,62 @@ http_parser_split_params(http_parser *parser, const char *at, size_t len, http_s
 
 
 	/* we have strings in the following format: at="ab=12&cd=34ø", len=11 */
+	end = at + len;
 
 	while(1) {
-		char *eq, *amp, *key, *val;
+		char *eq, *amp, *val;
+		const char *key;
 		size_t key_len, val_len;
 
-		/* find '=' */
-		eq = memchr(p, '=', p - at + len);
+		/* find '=', the key stays where it is. */
+		eq = memchr(p, '=', end - p);
 		if(!eq) break;
-
-		/* copy from the previous position to right before the '=' */
+		key = p;
 		key_len = eq - p;
-		key = rcalloc(1 + key_len, 1);
-		memcpy(key, p, key_len);
-
 
 		/* move 1 char to the right, now on data. */
 		p = eq + 1;
-		if(!*p) {
-			rfree(key);
+		if(p == end || !*p) {
 			break;
 		}
 
 		/* find the end of data, or the end of the string */
-		amp = memchr(p, '&', p - at + len);
+		amp = memchr(p, '&', end - p);
 		if(amp) {
 			val_len = amp - p;
 		} else {
-			val_len = at + len - p;
+			val_len = end - p;
 		}
 
 		/* copy data, from after the '=' to here. */
-		val = rcalloc(1 + val_len, 1);
+		if(!(val = arena_alloc(&cx->arena, 1 + val_len))) {
+			return -1;
+		}
 		memcpy(val, p, val_len);
+		val[val_len] = 0;
 
 		/* add to the GET dictionary */
-		if(strncmp(key, "name", 4) == 0 && cx->get.name == NULL) {
+		if(HTTP_KEY_IS(key, key_len, "name") && cx->get.name == NULL) {
 			cx->get.name = val;
 			cx->get.name_len = val_len;
-		} else if(strncmp(key, "data", 4) == 0 && cx->get.data == NULL) {
+		} else if(HTTP_KEY_IS(key, key_len, "data") && cx->get.data == NULL) {
 			cx->get.data = val;
 			cx->get.data_len = val_len;
-		} else if(strncmp(key, "jsonp", 5) == 0 && cx->get.jsonp == NULL) {
+		} else if(HTTP_KEY_IS(key, key_len, "jsonp") && cx->get.jsonp == NULL) {
 			cx->get.jsonp = val;
 			cx->get.jsonp_len = val_len;
-		} else if(strncmp(key, "domain", 6) == 0 && cx->get.domain == NULL) {
+		} else if(HTTP_KEY_IS(key, key_len, "domain") && cx->get.domain == NULL) {
 			cx->get.domain = val;
 			cx->get.domain_len = val_len;
-		} else if(strncmp(key, "seq", 3) == 0) {
+		} else if(HTTP_KEY_IS(key, key_len, "since")) {
+			cx->get.since = strtoull(val, NULL, 10);
+			cx->get.has_since = 1;
+		} else if(HTTP_KEY_IS(key, key_len, "seq")) {
 			cx->get.seq = atol(val);
 			cx->get.has_seq = 1;
-			rfree(val);
-		} else if(strncmp(key, "keep", 4) == 0) {
+		} else if(HTTP_KEY_IS(key, key_len, "keep")) {
 			cx->get.keep = atol(val);
-			rfree(val);
-		} else {
-			rfree(val);
 		}
-		rfree(key);
 
 		if(amp) { /* more to come */
 			p = amp + 1;
@@ -234,14 +258,46 @@ http_parser_split_params(http_parser *parser, const char *at, size_t len, http_s
 	return 0;
 }
 
+/**
+ * Append a piece of a request to one of our strings. The parser gives
+ * them in several calls when they are split between reads; the string
+ * grows in the arena of the connection and stays NUL-terminated.
+ */
+static int
+http_append(struct connection *cx, char **s, size_t *s_len, const char *at, size_t len) {
+
+	size_t need = *s_len + len + 1;
+	char *tmp;
+
+	if(need > CX_INPUT_MAX) { /* request too large */
+		cx->state = CX_BROKEN;
+		return -1;
+	}
+
+	if(!(tmp = arena_grow(&cx->arena, *s, *s ? *s_len + 1 : 0, need))) {
+		cx->state = CX_BROKEN;
+		return -1;
+	}
+	*s = tmp;
+	memcpy(*s + *s_len, at, len);
+	*s_len += len;
+	(*s)[*s_len] = 0;
+
+	return 0;
+}
+
 int
 http_parser_onurl(http_parser *parser, const char *at, size_t len) {
-	return http_parser_split_params(parser, at, len, ON_URL);
+
+	struct connection *cx = parser->data;
+	return http_append(cx, &cx->url, &cx->url_len, at, len);
 }
 
 int
 http_parser_onbody(http_parser *parser, const char *at, size_t len) {
-	return http_parser_split_params(parser, at, len, ON_BODY);
+
+	struct connection *cx = parser->data;
+	return http_append(cx, &cx->body, &cx->body_len, at, len);
 }
 
 
@@ -252,12 +308,7 @@ int
 http_parser_onpath(http_parser *parser, const char *at, size_t len) {
 
 	struct connection *cx = parser->data;
-
-	cx->path = rcalloc(1+len, 1);
-	memcpy(cx->path, at, len);
-	cx->path_len = len;
-
-	return 0;
+	return http_append(cx, &cx->path, &cx->path_len, at, len);
 }
 
 /**
@@ -268,8 +319,18 @@ http_parser_on_header_field(http_parser *parser, const char *at, size_t len) {
 
 	struct connection *cx = parser->data;
 
-	cx->header_next = rcalloc(len+1, 1); /* memorize the last seen */
-	memcpy(cx->header_next, at, len);
+	if(cx->header_value) { /* a new header starts */
+		cx->header_next_len = 0;
+		cx->header_value = 0;
+	}
+
+	/* memorize the beginning of the last seen, it is only compared. */
+	if(len > sizeof(cx->header_next) - 1 - cx->header_next_len) {
+		len = sizeof(cx->header_next) - 1 - cx->header_next_len;
+	}
+	memcpy(cx->header_next + cx->header_next_len, at, len);
+	cx->header_next_len += len;
+	cx->header_next[cx->header_next_len] = 0;
 
 	return 0;
 }
@@ -282,24 +343,43 @@ http_parser_on_header_value (http_parser *parser, const char *at, size_t len) {
 
 	struct connection *cx = parser->data;
 
+	cx->header_value = 1;
+	if(!cx->header_next_len) {
+		return 0;
+	}
+
 	if(strncmp(cx->header_next, "Host", 4) == 0) { /* copy the "Host" header. */
-		cx->headers.host_len = len;
-		cx->headers.host = rcalloc(len + 1, 1);
-		memcpy(cx->headers.host, at, len);
+		return http_append(cx, &cx->headers.host, &cx->headers.host_len, at, len);
 	} else if(strncmp(cx->header_next, "Origin", 6) == 0) { /* copy the "Origin" header. */
-		cx->headers.origin_len = len;
-		cx->headers.origin = rcalloc(len + 1, 1);
-		memcpy(cx->headers.origin, at, len);
+		return http_append(cx, &cx->headers.origin, &cx->headers.origin_len, at, len);
 	} else if(strncmp(cx->header_next, "Sec-WebSocket-Key1", 18) == 0) {
-		cx->headers.ws1_len = len;
-		cx->headers.ws1 = rcalloc(len + 1, 1);
-		memcpy(cx->headers.ws1, at, len);
+		return http_append(cx, &cx->headers.ws1, &cx->headers.ws1_len, at, len);
 	} else if(strncmp(cx->header_next, "Sec-WebSocket-Key2", 18) == 0) {
-		cx->headers.ws2_len = len;
-		cx->headers.ws2 = rcalloc(len + 1, 1);
-		memcpy(cx->headers.ws2, at, len);
+		return http_append(cx, &cx->headers.ws2, &cx->headers.ws2_len, at, len);
+	} else if(cx->header_next_len == 17 && strncmp(cx->header_next, "Sec-WebSocket-Key", 17) == 0) {
+		return http_append(cx, &cx->headers.ws_key, &cx->headers.ws_key_len, at, len);
+	} else if(cx->header_next_len == 24 && strncmp(cx->header_next, "Sec-WebSocket-Extensions", 24) == 0) {
+		return http_append(cx, &cx->headers.ws_ext, &cx->headers.ws_ext_len, at, len);
 	}
-	rfree(cx->header_next);
-	cx->header_next = NULL;
 	return 0;
 }
+
+/**
+ * End of a request: stop there, the next one will be parsed separately.
+ */
+int
+http_parser_on_message_complete(http_parser *parser) {
+
+	struct connection *cx = parser->data;
+
+	/* the whole request is here, read its parameters. */
+	if(cx->url) {
+		http_split_params(cx, cx->url, cx->url_len, ON_URL);
+	}
+	if(cx->body) {
+		http_split_params(cx, cx->body, cx->body_len, ON_BODY);
+	}
+
+	cx->request_done = 1;
+	return 1;
+}
@@ -4,11 +4,14 @@
 #include "http-parser/http_parser.h"
 struct connection;
 
-typedef enum {HTTP_DISCONNECT, HTTP_KEEP_CONNECTED, HTTP_WEBSOCKET_MONITOR} http_action;
+typedef enum {HTTP_DISCONNECT, HTTP_KEEP_CONNECTED, HTTP_WEBSOCKET_MONITOR, HTTP_HANDOFF,
+	HTTP_KEEP_ALIVE} http_action;
 typedef enum {ON_URL, ON_BODY} http_step;
-typedef int (*write_function)(struct connection *cx, const char *data, size_t len);
 typedef int (*start_function)(struct connection *cx);
 
+/* frames data for a given transport */
+typedef char *(*encode_function)(const char *data, size_t len, size_t *out_len);
+
 
 /* Send an HTTP response */
 int
@@ -31,6 +34,10 @@ http_streaming_start_ct(struct connection *cx, int code, const char *status, con
 int
 http_streaming_chunk(struct connection *cx, const char *data, size_t len);
 
+/* Encode data as a chunk */
+char *
+http_chunk_encode(const char *data, size_t len, size_t *out_len);
+
 /* Stop streaming, close connection. */
 void
 http_streaming_end(struct connection *cx);
@@ -50,4 +57,7 @@ http_parser_on_header_field(http_parser *parser, const char *at, size_t len);
 int
 http_parser_on_header_value(http_parser *parser, const char *at, size_t len);
 
+int
+http_parser_on_message_complete(http_parser *parser);
+
 #endif
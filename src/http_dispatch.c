@@ -8,8 +8,23 @@
 #include "channel.h"
 #include "websocket.h"
 #include "files.h"
+#include "worker.h"
+#include "heartbeat.h"
+#include "deadline.h"
 #include "mem.h"
 
+/**
+ * Publishers can send more requests on the same connection.
+ */
+static http_action
+http_keep_alive(struct connection *cx) {
+
+	if(cx->request_done && http_should_keep_alive(&cx->parser)) {
+		return HTTP_KEEP_ALIVE;
+	}
+	return HTTP_DISCONNECT;
+}
+
 static int
 start_fun_http(struct connection *cx) {
 	http_streaming_start(cx, 200, "OK");
@@ -25,15 +40,28 @@ http_dispatch(struct connection *cx) {
 	if(cx->path_len == 8 && 0 == strncmp(cx->path, "/publish", 8)) {
 		cx->state = CX_PUBLISHING;
 		return http_dispatch_publish(cx);
+	} else if(cx->path_len == 14 && 0 == strncmp(cx->path, "/publish_batch", 14)) {
+		cx->state = CX_PUBLISHING;
+		return http_dispatch_publish_batch(cx);
 	} else if(cx->path_len == 10 && 0 == strncmp(cx->path, "/subscribe", 10)) {
 		cx->state = CX_CONNECTED_COMET;
-		return http_dispatch_read(cx, start_fun_http, http_streaming_chunk);
+		return http_dispatch_read(cx, start_fun_http, http_chunk_encode);
 	} else if(cx->path_len == 10 && 0 == strncmp(cx->path, "/websocket", 10)) {
+		http_action ret;
 		cx->state = CX_CONNECTED_WEBSOCKET;
-		if(HTTP_KEEP_CONNECTED == http_dispatch_read(cx, ws_start, ws_write)) {
+		if(cx->headers.ws_key) { /* RFC 6455 */
+			ret = http_dispatch_read(cx, ws13_start, ws13_encode);
+		} else { /* hixie-76 */
+			ret = http_dispatch_read(cx, ws_start, ws_encode);
+		}
+		if(HTTP_KEEP_CONNECTED == ret) {
 			return HTTP_WEBSOCKET_MONITOR;
+		} else if(HTTP_HANDOFF == ret) {
+			return HTTP_HANDOFF;
 		}
 		return HTTP_DISCONNECT;
+	} else if(cx->path_len == 6 && 0 == strncmp(cx->path, "/stats", 6)) {
+		return http_dispatch_stats(cx);
 	} else if(file_send(cx) == 0) { /* check if we're sending a file. */
 		cx->state = CX_SENDING_FILE;
 		return HTTP_DISCONNECT;
@@ -48,24 +76,39 @@ http_dispatch(struct connection *cx) {
  * Perform a read on the channel, with two callback functions.
  *
  * @param start_fun is called when the client is allowed to connect.
- * @param write_fun is called to write data to the client.
+ * @param encode_fun frames channel messages for the client's transport.
  */
 http_action
-http_dispatch_read(struct connection *cx, start_function start_fun, write_function write_fun) {
+http_dispatch_read(struct connection *cx, start_function start_fun,
+		encode_function encode_fun) {
 
 	http_action ret = HTTP_KEEP_CONNECTED;
+	struct worker *w;
 
 	if(!cx->get.name) {
 		send_empty_reply(cx, 400);
 		return HTTP_DISCONNECT;
 	}
 
+	/* the channel lives in another event loop, the caller moves the
+	 * connection there once it's done with it. */
+	if((w = worker_owner(cx->get.name, cx->get.name_len)) != worker_current()) {
+		cx->handoff = w;
+		return HTTP_HANDOFF;
+	}
+
+	/* still over max_memory without the histories: turn them away. */
+	if(channel_over_limit()) {
+		send_empty_reply(cx, 503);
+		return HTTP_DISCONNECT;
+	}
+
 	/* find channel */
-	if(!(cx->channel = channel_find(cx->get.name))) {
+	if(!(cx->channel = channel_find(cx->get.name, cx->get.name_len))) {
 		cx->channel = channel_new(cx->get.name);
 	}
 
-	cx->cu = channel_new_connection(cx, cx->get.keep, cx->get.jsonp, write_fun);
+	cx->cu = channel_new_connection(cx, cx->get.keep, cx->get.jsonp, encode_fun);
 	if(-1 == start_fun(cx)) {
 		return HTTP_DISCONNECT;
 	}
@@ -86,33 +129,24 @@ http_dispatch_read(struct connection *cx, start_function start_fun, write_functi
 		} else {
 			/* case 2*/
 		}
+	} else if(cx->get.has_since) {
+		ret = channel_catchup_since(cx->channel, cx->cu, cx->get.since);
+		/* case 1 */
+		if(ret == HTTP_DISCONNECT) {
+			return HTTP_DISCONNECT;
+		} else {
+			/* case 2*/
+		}
 	} else {
 		/* case 3 */
 	}
 
 	/* stay connected: add cu to channel. */
 	channel_add_connection(cx->channel, cx->cu);
+	heartbeat_start(cx);
 
 	/* add timeout to avoid keeping the user for too long. */
-#if 0
-	if(__cfg->client_timeout > 0) {
-		struct user_timeout *ut;
-
-		cx->cu->free_on_remove = 0;
-
-		ut = rcalloc(1, sizeof(struct user_timeout));
-		ut->cu = cx->cu;
-		ut->channel = cx->channel;
-
-		/* timeout value. */
-		ut->tv.tv_sec = __cfg->client_timeout;
-		ut->tv.tv_usec = 0;
-
-		/* add timeout event */
-		timeout_set(&ut->ev, on_client_too_old, ut);
-		event_base_set(cx->base, &ut->ev);
-		timeout_add(&ut->ev, &ut->tv);
-#endif
+	deadline_client(cx);
 
 	return ret;
 }
@@ -124,26 +158,118 @@ http_dispatch_read(struct connection *cx, start_function start_fun, write_functi
  */
 http_action
 http_dispatch_publish(struct connection *cx) {
-	struct channel *channel;
 
 	if(!cx->get.name || !cx->get.data) {
 		send_empty_reply(cx, 403);
-		return HTTP_DISCONNECT;
+		return http_keep_alive(cx);
 	}
 
-	/* find channel */
-	if(!(channel = channel_find(cx->get.name))) {
-		send_empty_reply(cx, 200); /* pretend we just did. */
-		return HTTP_DISCONNECT;
+	/* unknown channels are ignored, pretend we just wrote. */
+	send_empty_reply(cx, 200);
+
+	/* send to all channel users, in the event loop owning the channel. */
+	worker_publish(cx->get.name, cx->get.name_len, cx->get.data, cx->get.data_len);
+
+	return http_keep_alive(cx);
+}
+
+/**
+ * Read a netstring ("5:hello,") at *p, and move *p after it.
+ * Returns the start of the string or NULL if it is malformed.
+ */
+static const char *
+netstring_read(const char **p, const char *end, size_t *len) {
+
+	const char *s = *p, *ret;
+	size_t n = 0;
+
+	for(; s < end && *s >= '0' && *s <= '9'; s++) {
+		n = n * 10 + (*s - '0');
+		if(n > (size_t)(end - *p)) {
+			return NULL;
+		}
+	}
+	if(s == *p || s == end || *s != ':' || n >= (size_t)(end - s - 1)
+			|| s[1 + n] != ',') {
+		return NULL;
+	}
+
+	ret = s + 1;
+	*len = n;
+	*p = ret + n + 1;
+	return ret;
+}
+
+/**
+ * Publishes many messages at once.
+ *
+ * The body is a list of netstring pairs, "4:chan,5:hello,4:room,2:hi,"
+ * publishes "hello" in "chan" and "hi" in "room".
+ * Nothing is published if the body is malformed.
+ */
+http_action
+http_dispatch_publish_batch(struct connection *cx) {
+
+	const char *p, *end;
+	struct iovec *msgs = NULL, *tmp; /* name and data of each message */
+	unsigned int i, count = 0, size = 0;
+
+	if(!cx->body) {
+		send_empty_reply(cx, 403);
+		return http_keep_alive(cx);
+	}
+	end = cx->body + cx->body_len;
+
+	/* parse the whole batch first */
+	for(p = cx->body; p < end; count += 2) {
+		if(count == size) {
+			size = size ? 2 * size : 32;
+			tmp = rmalloc(size * sizeof(struct iovec));
+			memcpy(tmp, msgs, count * sizeof(struct iovec));
+			rfree(msgs);
+			msgs = tmp;
+		}
+		if(!(msgs[count].iov_base = (void *)netstring_read(&p, end, &msgs[count].iov_len))
+				|| !msgs[count].iov_len
+				|| !(msgs[count + 1].iov_base = (void *)netstring_read(&p, end,
+						&msgs[count + 1].iov_len))) {
+			rfree(msgs);
+			send_empty_reply(cx, 400);
+			return http_keep_alive(cx);
+		}
 	}
 
 	send_empty_reply(cx, 200);
 
-	/* send to all channel users. */
-	channel_write(channel, cx->get.data, cx->get.data_len);
+	for(i = 0; i < count; i += 2) {
+		worker_publish(msgs[i].iov_base, msgs[i].iov_len,
+				msgs[i + 1].iov_base, msgs[i + 1].iov_len);
+	}
+	rfree(msgs);
 
-	return HTTP_DISCONNECT;
+	return http_keep_alive(cx);
 }
 
+/**
+ * Memory in use, in bytes, in total and per subsystem.
+ */
+http_action
+http_dispatch_stats(struct connection *cx) {
 
+	char buffer[512];
+	int len, sub;
 
+	len = snprintf(buffer, sizeof(buffer),
+			"{\"memory\": {\"used\": %lu, \"max\": %lu, \"reserved\": %lu",
+			(unsigned long)mem_total(), (unsigned long)max_memory,
+			(unsigned long)mem_reserved());
+	for(sub = 0; sub < MEM_SUBSYSTEMS; ++sub) {
+		len += snprintf(buffer + len, sizeof(buffer) - len, ", \"%s\": %lu",
+				mem_subsystem_name((mem_subsystem)sub),
+				(unsigned long)mem_used((mem_subsystem)sub));
+	}
+	len += snprintf(buffer + len, sizeof(buffer) - len, "}}\r\n");
+
+	http_response_ct(cx, 200, "OK", buffer, len, "application/json");
+	return http_keep_alive(cx);
+}
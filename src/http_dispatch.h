@@ -11,8 +11,14 @@ http_dispatch(struct connection *cx);
 http_action
 http_dispatch_publish(struct connection *cx);
 
+http_action
+http_dispatch_publish_batch(struct connection *cx);
+
+http_action
+http_dispatch_stats(struct connection *cx);
+
 http_action
 http_dispatch_read(struct connection *cx, start_function start_fun,
-		write_function write_fun);
+		encode_function encode_fun);
 
 #endif
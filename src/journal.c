@@ -0,0 +1,639 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "channel.h"
+#include "history.h"
+#include "worker.h"
+#include "conf.h"
+#include "mem.h"
+
+#define JOURNAL_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+/* offsets are 32 bits */
+#define JOURNAL_MAX_SEGMENT	(1UL << 31)
+
+#define JOURNAL_MIN_INDEX	8
+
+struct journal_record {
+	uint32_t magic;
+	uint32_t check;
+	uint64_t seq;
+	uint64_t time;
+	uint32_t name_len;
+	uint32_t data_len;
+};
+
+struct journal_segment {
+	uint32_t id;
+	int fd;
+	char *base;
+	size_t size;
+
+	size_t written; /* appended by the worker, read by the sync thread */
+	size_t synced; /* only used by the sync thread */
+
+	/* idle channels whose last message is in this segment. */
+	struct channel_list dormant;
+
+	struct journal_segment *next; /* retired segments */
+};
+
+struct journal {
+	int worker;
+	pthread_t thread;
+
+	/* protects the segment ring against the sync thread, which is woken
+	 * up when the spare segment has been taken. */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int started; /* the sync thread prepares the segments */
+
+	/* the last segments, by id: segs[id % capacity], the current one is `last'. */
+	struct journal_segment **segs;
+	unsigned int capacity;
+	unsigned int count;
+	uint32_t last;
+
+	uint32_t next_id;
+	struct journal_segment *spare; /* created ahead by the sync thread */
+	struct journal_segment *retired; /* to be deleted by the sync thread */
+
+	time_t failed; /* don't retry creating a segment in the same second */
+};
+
+/* segment files found on startup, replayed by every worker. */
+struct journal_file {
+	uint32_t id;
+	char *path;
+};
+
+static char *__dir = NULL;
+static size_t __segment_size;
+static int __sync_ms;
+static struct journal *__journals = NULL;
+static struct journal_file *__files = NULL;
+static int __file_count = 0;
+static uint32_t __first_id = 1;
+static pthread_barrier_t __replayed;
+
+static __thread struct journal *__journal = NULL;
+
+static int
+journal_file_cmp(const void *a, const void *b) {
+
+	const struct journal_file *fa = a, *fb = b;
+
+	return fa->id < fb->id ? -1 : (fa->id > fb->id);
+}
+
+/**
+ * List the segments left by the previous run, oldest first.
+ */
+static int
+journal_scan(const char *dir) {
+
+	DIR *d;
+	struct dirent *de;
+	unsigned int id;
+	int worker, n, size = 0;
+
+	if(!(d = opendir(dir))) {
+		syslog(LOG_ERR, "can't open journal directory %s: %m\n", dir);
+		return -1;
+	}
+	while((de = readdir(d))) {
+		if(sscanf(de->d_name, "river-%u-%d.log%n", &id, &worker, &n) != 2
+				|| de->d_name[n]) {
+			continue;
+		}
+		if(__file_count == size) {
+			struct journal_file *files;
+			size = size ? 2 * size : 16;
+			files = rmalloc(size * sizeof(struct journal_file));
+			memcpy(files, __files, __file_count * sizeof(struct journal_file));
+			rfree(__files);
+			__files = files;
+		}
+		__files[__file_count].id = id;
+		__files[__file_count].path = rmalloc(strlen(dir) + strlen(de->d_name) + 2);
+		sprintf(__files[__file_count].path, "%s/%s", dir, de->d_name);
+		__file_count++;
+		if(id >= __first_id) {
+			__first_id = id + 1;
+		}
+	}
+	closedir(d);
+
+	qsort(__files, __file_count, sizeof(struct journal_file), journal_file_cmp);
+	return 0;
+}
+
+/**
+ * Read the configuration and list the existing segments, before the workers start.
+ */
+int
+journal_init(struct conf *cfg, int workers) {
+
+	int i;
+
+	if(!cfg->journal_dir) {
+		return 0;
+	}
+	__dir = cfg->journal_dir;
+	__sync_ms = cfg->journal_sync > 0 ? cfg->journal_sync : 1;
+	__segment_size = cfg->journal_segment_size;
+	if(__segment_size > JOURNAL_MAX_SEGMENT) {
+		__segment_size = JOURNAL_MAX_SEGMENT;
+	}
+	__segment_size = JOURNAL_ALIGN(__segment_size);
+
+	if(mkdir(__dir, 0755) == -1 && errno != EEXIST) {
+		syslog(LOG_ERR, "can't create journal directory %s: %m\n", __dir);
+		return -1;
+	}
+	if(journal_scan(__dir) != 0) {
+		return -1;
+	}
+
+	__journals = rcalloc(workers, sizeof(struct journal));
+	for(i = 0; i < workers; ++i) {
+		struct journal *j = &__journals[i];
+
+		j->worker = i;
+		j->capacity = cfg->journal_segments > 0 ? cfg->journal_segments : 1;
+		j->segs = rcalloc(j->capacity, sizeof(struct journal_segment *));
+		j->next_id = __first_id;
+		pthread_mutex_init(&j->lock, NULL);
+		pthread_cond_init(&j->wake, NULL);
+	}
+	pthread_barrier_init(&__replayed, NULL, workers);
+
+	return 0;
+}
+
+/**
+ * A new segment, preallocated and mapped. Slow: called by the sync thread,
+ * or by the worker while it replays the old segments, without the lock.
+ */
+static struct journal_segment *
+journal_segment_new(struct journal *j) {
+
+	struct journal_segment *s;
+	char path[1024];
+	int fd;
+	void *base;
+
+	snprintf(path, sizeof(path), "%s/river-%u-%d.log", __dir, j->next_id, j->worker);
+
+	if((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) == -1) {
+		syslog(LOG_ERR, "can't create journal segment %s: %m\n", path);
+		return NULL;
+	}
+	/* allocate the blocks now, so that writes don't have to. */
+	if(posix_fallocate(fd, 0, __segment_size) != 0) {
+		syslog(LOG_ERR, "can't allocate journal segment %s\n", path);
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	base = mmap(NULL, __segment_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, 0);
+	if(base == MAP_FAILED) {
+		syslog(LOG_ERR, "can't map journal segment %s: %m\n", path);
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	s = rcalloc(1, sizeof(struct journal_segment));
+	s->id = j->next_id++;
+	s->fd = fd;
+	s->base = base;
+	s->size = __segment_size;
+
+	return s;
+}
+
+static void
+journal_segment_free(struct journal_segment *s) {
+
+	munmap(s->base, s->size);
+	close(s->fd);
+	rfree(s);
+}
+
+static struct journal_segment *
+journal_segment(struct journal *j, uint32_t id) {
+
+	if(!j->count || id > j->last || j->last - id >= j->count) {
+		return NULL;
+	}
+	return j->segs[id % j->capacity];
+}
+
+/**
+ * Start writing to a new segment, dropping the oldest one if we have too many.
+ * Once the sync thread runs, this only takes the spare segment: if it isn't
+ * ready yet, messages aren't journaled until it is.
+ */
+static struct journal_segment *
+journal_rotate(struct journal *j) {
+
+	struct journal_segment *s = NULL, *old;
+	time_t now;
+
+	if(!j->started) { /* replaying */
+		now = time(NULL);
+		if(j->failed == now || !(s = journal_segment_new(j))) {
+			j->failed = now;
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&j->lock);
+	if(!s && (s = j->spare)) {
+		j->spare = NULL;
+		pthread_cond_signal(&j->wake); /* prepare the next one */
+	}
+	if(s) {
+		if(j->count == j->capacity) {
+			old = j->segs[s->id % j->capacity];
+			channel_idle_requeue(&old->dormant); /* they can go now */
+			old->next = j->retired;
+			j->retired = old;
+			j->count--;
+		}
+		j->segs[s->id % j->capacity] = s;
+		j->last = s->id;
+		j->count++;
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return s;
+}
+
+static uint32_t
+journal_check(const struct journal_record *rec) {
+
+	const unsigned char *p = (const unsigned char *)&rec->seq;
+	size_t i, len = sizeof(*rec) - offsetof(struct journal_record, seq)
+		+ rec->name_len + rec->data_len;
+	uint32_t h = 2166136261U;
+
+	for(i = 0; i < len; ++i) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+	return h;
+}
+
+static void
+journal_index_add(struct journal_index *ji, unsigned long long seq,
+		uint32_t seg, uint32_t off) {
+
+	struct journal_ref *refs;
+	unsigned int i, capacity;
+
+	if(ji->count && seq != ji->first_seq + ji->count) { /* missed some */
+		ji->count = 0;
+	}
+	if(!ji->count) {
+		ji->first = 0;
+		ji->first_seq = seq;
+	}
+	if(ji->count == ji->capacity) {
+		capacity = ji->capacity ? 2 * ji->capacity : JOURNAL_MIN_INDEX;
+		refs = rmalloc_in(MEM_HISTORY, capacity * sizeof(struct journal_ref));
+		for(i = 0; i < ji->count; ++i) {
+			refs[i] = ji->refs[(ji->first + i) % ji->capacity];
+		}
+		rfree(ji->refs);
+		ji->refs = refs;
+		ji->capacity = capacity;
+		ji->first = 0;
+	}
+	refs = &ji->refs[(ji->first + ji->count) % ji->capacity];
+	refs->seg = seg;
+	refs->off = off;
+	ji->count++;
+}
+
+/**
+ * Forget the messages of the segments which have been dropped.
+ */
+static void
+journal_index_prune(struct journal *j, struct journal_index *ji) {
+
+	uint32_t oldest = j->last - j->count + 1;
+
+	while(ji->count && (!j->count || ji->refs[ji->first].seg < oldest)) {
+		ji->first = (ji->first + 1) % ji->capacity;
+		ji->first_seq++;
+		ji->count--;
+	}
+	if(!ji->count) {
+		journal_index_free(ji);
+	}
+}
+
+void
+journal_index_free(struct journal_index *ji) {
+
+	rfree(ji->refs);
+	memset(ji, 0, sizeof(*ji));
+}
+
+static void
+journal_write(struct journal *j, struct channel *channel, unsigned long long seq,
+		unsigned long long time, const char *data, size_t len) {
+
+	struct journal_segment *s = j->count ? j->segs[j->last % j->capacity] : NULL;
+	struct journal_record *rec;
+	size_t need = JOURNAL_ALIGN(sizeof(struct journal_record) + channel->name_len + len);
+	size_t off;
+
+	if(need > __segment_size) { /* too big, the index starts over after it. */
+		journal_index_free(&channel->journal);
+		return;
+	}
+	if((!s || s->written + need > s->size) && !(s = journal_rotate(j))) {
+		journal_index_free(&channel->journal);
+		return;
+	}
+
+	off = s->written;
+	rec = (struct journal_record *)(s->base + off);
+	rec->seq = seq;
+	rec->time = time;
+	rec->name_len = (uint32_t)channel->name_len;
+	rec->data_len = (uint32_t)len;
+	memcpy(rec + 1, channel->name, channel->name_len);
+	memcpy((char *)(rec + 1) + channel->name_len, data, len);
+	rec->check = journal_check(rec);
+	rec->magic = JOURNAL_MAGIC;
+	__atomic_store_n(&s->written, off + need, __ATOMIC_RELEASE);
+
+	journal_index_prune(j, &channel->journal);
+	journal_index_add(&channel->journal, seq, s->id, (uint32_t)off);
+}
+
+/**
+ * Append a message to the journal of the current worker, if there is one.
+ */
+void
+journal_append(struct channel *channel, unsigned long long seq,
+		const char *data, size_t len) {
+
+	if(__journal) {
+		journal_write(__journal, channel, seq, history_to_epoch(history_clock()),
+				data, len);
+	}
+}
+
+/**
+ * First message of a channel still in the journal, 0 if there is none.
+ */
+unsigned long long
+journal_first(struct channel *channel) {
+
+	if(!__journal) {
+		return 0;
+	}
+	journal_index_prune(__journal, &channel->journal);
+	return channel->journal.count ? channel->journal.first_seq : 0;
+}
+
+/**
+ * A message from the mapped segments, valid until the next write.
+ */
+const char *
+journal_get(struct channel *channel, unsigned long long seq, size_t *len) {
+
+	struct journal_index *ji = &channel->journal;
+	struct journal_segment *s;
+	struct journal_ref *ref;
+	struct journal_record *rec;
+
+	if(!__journal || seq < ji->first_seq || seq >= ji->first_seq + ji->count) {
+		return NULL;
+	}
+	ref = &ji->refs[(ji->first + (seq - ji->first_seq)) % ji->capacity];
+	if(!(s = journal_segment(__journal, ref->seg))) {
+		return NULL;
+	}
+	rec = (struct journal_record *)(s->base + ref->off);
+	*len = rec->data_len;
+	return (const char *)(rec + 1) + rec->name_len;
+}
+
+/**
+ * The list to keep an idle channel in while its messages are on disk,
+ * so that its sequence numbers go on if it comes back. NULL to free it.
+ */
+struct channel_list *
+journal_dormant(struct channel *channel) {
+
+	struct journal_index *ji = &channel->journal;
+	struct journal_segment *s;
+
+	if(!__journal) {
+		return NULL;
+	}
+	journal_index_prune(__journal, ji);
+	if(!ji->count) {
+		return NULL;
+	}
+	s = journal_segment(__journal, ji->refs[(ji->first + ji->count - 1) % ji->capacity].seg);
+	return s ? &s->dormant : NULL;
+}
+
+/**
+ * Flushes the new records to disk, deletes the old segments and
+ * prepares the next one, away from the event loop.
+ *
+ * The lock is only held to look at the segment ring: segments are freed
+ * by this thread alone, after the worker has retired them, so the ones
+ * seen in the ring stay valid while they are flushed.
+ */
+static void *
+journal_sync_main(void *ptr) {
+
+	struct journal *j = ptr;
+	struct journal_segment *s, *retired, **live;
+	unsigned int i, count;
+	size_t written;
+	int spare;
+	struct timespec deadline;
+	char path[1024];
+
+	live = rmalloc(j->capacity * sizeof(struct journal_segment *));
+
+	for(;;) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += __sync_ms / 1000;
+		deadline.tv_nsec += (__sync_ms % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&j->lock);
+		while((j->spare || j->failed == time(NULL))
+				&& pthread_cond_timedwait(&j->wake, &j->lock, &deadline) == 0);
+		for(count = 0; count < j->count; ++count) {
+			live[count] = j->segs[(j->last - count) % j->capacity];
+		}
+		spare = j->spare != NULL;
+		retired = j->retired;
+		j->retired = NULL;
+		pthread_mutex_unlock(&j->lock);
+
+		if(!spare && j->failed != time(NULL)) { /* first, the worker is waiting for it */
+			if((s = journal_segment_new(j))) {
+				pthread_mutex_lock(&j->lock);
+				j->spare = s;
+				pthread_mutex_unlock(&j->lock);
+			} else {
+				j->failed = time(NULL);
+			}
+		}
+
+		for(i = 0; i < count; ++i) {
+			s = live[i];
+			written = __atomic_load_n(&s->written, __ATOMIC_ACQUIRE);
+			if(written > s->synced) {
+				fdatasync(s->fd);
+				s->synced = written;
+			}
+		}
+
+		for(; (s = retired); ) {
+			retired = s->next;
+			snprintf(path, sizeof(path), "%s/river-%u-%d.log", __dir, s->id, j->worker);
+			unlink(path);
+			journal_segment_free(s);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Replay a message for a channel owned by the current worker.
+ */
+static void
+journal_replay(struct journal *j, const char *name, size_t name_len,
+		unsigned long long seq, unsigned long long time, const char *data, size_t len) {
+
+	struct channel *channel;
+	char *tmp;
+
+	if(!(channel = channel_find(name, name_len))) {
+		tmp = rmalloc(name_len + 1);
+		memcpy(tmp, name, name_len);
+		tmp[name_len] = 0;
+		channel = channel_new(tmp);
+		rfree(tmp);
+		if(!channel) {
+			return;
+		}
+	}
+	if(seq <= channel->seq) { /* copied already */
+		return;
+	}
+	channel->seq = seq;
+
+	history_append(&channel->history, seq, history_from_epoch(time), data, len);
+
+	journal_write(j, channel, seq, time, data, len);
+}
+
+static void
+journal_replay_file(struct journal *j, struct journal_file *f) {
+
+	struct journal_record *rec;
+	struct stat st;
+	char *base, *name;
+	size_t off = 0;
+	int fd;
+
+	if((fd = open(f->path, O_RDONLY)) == -1) {
+		syslog(LOG_ERR, "can't open journal segment %s: %m\n", f->path);
+		return;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size == 0
+		|| (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	while(off + sizeof(struct journal_record) <= (size_t)st.st_size) {
+		rec = (struct journal_record *)(base + off);
+		if(rec->magic != JOURNAL_MAGIC
+			|| (size_t)rec->name_len + rec->data_len > (size_t)st.st_size - off - sizeof(*rec)
+			|| rec->check != journal_check(rec)) {
+			break; /* end of the segment */
+		}
+		name = (char *)(rec + 1);
+		if(worker_owner(name, rec->name_len)->id == j->worker) {
+			journal_replay(j, name, rec->name_len, rec->seq, rec->time,
+					name + rec->name_len, rec->data_len);
+		}
+		off += JOURNAL_ALIGN(sizeof(*rec) + rec->name_len + rec->data_len);
+	}
+
+	munmap(base, st.st_size);
+	close(fd);
+}
+
+/**
+ * Replay the old segments and start the journal of the current worker.
+ * Must run in the worker's thread, after channel_init.
+ */
+int
+journal_open(struct worker *w) {
+
+	struct journal *j;
+	int i;
+
+	if(!__journals) {
+		return 0;
+	}
+	j = &__journals[w->id];
+	__journal = j;
+
+	for(i = 0; i < __file_count; ++i) {
+		journal_replay_file(j, &__files[i]);
+	}
+
+	/* everything has been copied once all the workers are here. */
+	if(pthread_barrier_wait(&__replayed) == PTHREAD_BARRIER_SERIAL_THREAD) {
+		for(i = 0; i < __file_count; ++i) {
+			unlink(__files[i].path);
+			rfree(__files[i].path);
+		}
+		rfree(__files);
+		__files = NULL;
+		__file_count = 0;
+	}
+
+	/* the event loop never creates segments, get the first one ready. */
+	j->spare = journal_segment_new(j);
+	j->started = 1;
+	if(pthread_create(&j->thread, NULL, journal_sync_main, j) != 0) {
+		syslog(LOG_ERR, "can't start the journal thread: %m\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Durable channel log, enabled with `journal <dir>' in river.conf.
+ *
+ * Every worker appends the messages of its channels to its own segment
+ * files, `<dir>/river-<segment>-<worker>.log', written through a shared
+ * mapping. A thread per worker flushes them to disk every `journal_sync'
+ * milliseconds (so that publishers never wait for the disk) and prepares
+ * the next segment in advance; if a segment fills up before the next one
+ * is ready, messages are not journaled until it is. Only the last
+ * `journal_segments' segments are kept.
+ *
+ * Record, 8-byte aligned, in host byte order:
+ *	magic (32) | check (32) | seq (64) | time (64, ms since the epoch)
+ *	| name length (32) | data length (32) | name | data
+ * `check' is a hash of everything after it, a record which doesn't match
+ * ends the segment.
+ *
+ * On startup, every worker replays the existing segments for the channels
+ * it owns, rebuilding their sequence numbers and history, and copies them
+ * to its new segments. The old files are removed once all the workers are
+ * done, so the number of threads can change across restarts.
+ */
+
+#define JOURNAL_MAGIC	0x314a5652	/* "RVJ1" */
+
+struct channel;
+struct channel_list;
+struct conf;
+struct worker;
+
+/* where a message is stored */
+struct journal_ref {
+	uint32_t seg;
+	uint32_t off;
+};
+
+/* the journaled messages of a channel, a ring of consecutive seq numbers
+ * starting at first_seq. */
+struct journal_index {
+	unsigned long long first_seq;
+
+	struct journal_ref *refs;
+	unsigned int capacity;
+	unsigned int first;
+	unsigned int count;
+};
+
+int
+journal_init(struct conf *cfg, int workers);
+
+int
+journal_open(struct worker *w);
+
+void
+journal_append(struct channel *channel, unsigned long long seq,
+		const char *data, size_t len);
+
+const char *
+journal_get(struct channel *channel, unsigned long long seq, size_t *len);
+
+unsigned long long
+journal_first(struct channel *channel);
+
+struct channel_list *
+journal_dormant(struct channel *channel);
+
+void
+journal_index_free(struct journal_index *ji);
+
+#endif /* JOURNAL_H */
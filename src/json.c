@@ -18,7 +18,7 @@ json_escape(const char *data, size_t len, size_t *out_len) {
 		j++;
 	}
 	/* allocate output buffer */
-	ret = rcalloc(1 + j, 1);
+	ret = rcalloc_in(MEM_BUFFERS, 1 + j, 1);
 
 	j = 0;
 	/* copy into output buffer */
@@ -41,7 +41,7 @@ char *
 json_wrap(const char *data, size_t data_len, const char *jsonp, size_t jsonp_len, size_t *out) {
 
 	size_t sz = jsonp_len + 1 + data_len + 4;
-	char *buffer = rcalloc(sz + 1, 1);
+	char *buffer = rcalloc_in(MEM_BUFFERS, sz + 1, 1);
 
 	memcpy(buffer, jsonp, jsonp_len);
 	memcpy(buffer + jsonp_len, "(", 1);
@@ -84,7 +84,7 @@ json_msg(const char *channel, size_t channel_len,
 		+ data_len
 		+ sizeof(fmt3)-1;
 
-	pos = buffer = rcalloc(needed + 1, 1);
+	pos = buffer = rcalloc_in(MEM_BUFFERS, needed + 1, 1);
 	buffer[needed] = 0;
 
 	memcpy(pos, fmt0, sizeof(fmt0)-1);
@@ -1,42 +1,226 @@
 #include "mem.h"
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 size_t max_memory = 0;
-static size_t cur_memory = 0;
 
-#define HEADER_SIZE (sizeof(size_t))
+/* address space for the spans, which are committed one at a time */
+#define MEM_REGION	(64ULL*1024*1024*1024)
 
-void *
-rmalloc(size_t size) {
+#define MEM_CLASSES	16
+static const size_t __classes[MEM_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+static const char *__names[MEM_SUBSYSTEMS] = {
+	"other", "channels", "history", "connections", "buffers"};
+
+/* a free block */
+struct mem_block {
+	struct mem_block *next;
+};
+
+struct mem_pool {
+	struct mem_block *free;
+	struct mem_block *remote; /* freed by other threads */
+
+	/* rest of the last span */
+	char *carve;
+	char *carve_end;
+};
+
+/* at the start of every span, followed by its blocks */
+struct mem_span {
+	struct mem_pool *pool;
+	unsigned int cls;
+	mem_subsystem sub;
+};
+#define MEM_SPAN_HEADER		64
+
+/* in front of a large block, keeps it aligned on 16 bytes */
+struct mem_large {
+	size_t size;
+	mem_subsystem sub;
+};
+#define MEM_LARGE_HEADER	16
+
+/* pools and counters of a thread, never freed since its blocks can outlive it. */
+struct mem_thread {
+	struct mem_pool pools[MEM_SUBSYSTEMS][MEM_CLASSES];
+	/* less blocks freed here from other threads. Only changed by the
+	 * thread, read by all of them. */
+	long used[MEM_SUBSYSTEMS];
+
+	struct mem_thread *next;
+};
+
+static char *__region = NULL;
+static size_t __region_size = 0;
+static size_t __region_next = 0;
+static pthread_once_t __region_once = PTHREAD_ONCE_INIT;
+
+static struct mem_thread *__threads = NULL;
+static pthread_mutex_t __threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct mem_thread *__self = NULL;
 
-	void *ptr;
+/**
+ * Reserve the address space of the spans, as much as we can get.
+ * Without it, all the blocks are large ones.
+ */
+static void
+mem_reserve(void) {
 
-	if(max_memory && cur_memory > max_memory) {
+	size_t size;
+	void *p;
+
+	for(size = MEM_REGION; size >= 16 * MEM_SPAN; size /= 2) {
+		p = mmap(NULL, size + MEM_SPAN, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(p != MAP_FAILED) { /* spans are aligned on their size */
+			__region = (char *)(((uintptr_t)p + MEM_SPAN - 1) & ~(uintptr_t)(MEM_SPAN - 1));
+			__region_size = size;
+			return;
+		}
+	}
+}
+
+static struct mem_thread *
+mem_thread() {
+
+	struct mem_thread *t;
+
+	if(__self) {
+		return __self;
+	}
+	pthread_once(&__region_once, mem_reserve);
+	if(!(t = calloc(1, sizeof(struct mem_thread)))) {
 		return NULL;
 	}
+	pthread_mutex_lock(&__threads_lock);
+	t->next = __threads;
+	__threads = t;
+	pthread_mutex_unlock(&__threads_lock);
 
-	cur_memory += size;
-	ptr = malloc(size + HEADER_SIZE);
-	memcpy(ptr, &size, HEADER_SIZE);
-	return ptr + HEADER_SIZE;
+	return __self = t;
 }
 
-void *
-rcalloc(size_t nmemb, size_t size) {
-	
-	void *ptr;
-	size_t total = nmemb * size;
+static void
+mem_count(struct mem_thread *t, mem_subsystem sub, long delta) {
 
-	if(max_memory && cur_memory > max_memory) {
+	long used = __atomic_load_n(&t->used[sub], __ATOMIC_RELAXED);
+
+	__atomic_store_n(&t->used[sub], used + delta, __ATOMIC_RELAXED);
+}
+
+static unsigned int
+mem_class(size_t size) {
+
+	unsigned int cls = 0;
+
+	while(__classes[cls] < size) {
+		cls++;
+	}
+	return cls;
+}
+
+/**
+ * Give a new span to a pool.
+ */
+static int
+mem_span_new(struct mem_pool *pool, unsigned int cls, mem_subsystem sub) {
+
+	size_t off = __sync_fetch_and_add(&__region_next, MEM_SPAN);
+	struct mem_span *span;
+
+	if(off + MEM_SPAN > __region_size) { /* all taken */
+		return -1;
+	}
+	span = (struct mem_span *)(__region + off);
+	if(mprotect(span, MEM_SPAN, PROT_READ | PROT_WRITE) != 0) {
+		return -1;
+	}
+	span->pool = pool;
+	span->cls = cls;
+	span->sub = sub;
+
+	pool->carve = (char *)span + MEM_SPAN_HEADER;
+	pool->carve_end = (char *)span + MEM_SPAN;
+	return 0;
+}
+
+static void *
+mem_alloc(mem_subsystem sub, size_t size, int zero) {
+
+	struct mem_thread *t = mem_thread();
+	struct mem_pool *pool;
+	struct mem_block *b;
+	struct mem_large *l;
+	unsigned int cls;
+
+	if(!t) {
 		return NULL;
 	}
 
-	cur_memory += total;
-	ptr = calloc(1, total + HEADER_SIZE);
-	memcpy(ptr, &total, HEADER_SIZE);
-	return ptr + HEADER_SIZE;
+	if(size <= MEM_SMALL_MAX && __region) {
+		cls = mem_class(size);
+		pool = &t->pools[sub][cls];
+
+		if(!pool->free && pool->remote) { /* take them back all at once */
+			pool->free = __sync_lock_test_and_set(&pool->remote, NULL);
+		}
+		if((b = pool->free)) {
+			pool->free = b->next;
+		} else if((size_t)(pool->carve_end - pool->carve) >= __classes[cls]
+				|| mem_span_new(pool, cls, sub) == 0) {
+			b = (struct mem_block *)pool->carve;
+			pool->carve += __classes[cls];
+		}
+		if(b) {
+			mem_count(t, sub, (long)__classes[cls]);
+			if(zero) {
+				memset(b, 0, size);
+			}
+			return b;
+		}
+		/* out of spans, carry on with a large block. */
+	}
+
+	l = zero ? calloc(1, MEM_LARGE_HEADER + size) : malloc(MEM_LARGE_HEADER + size);
+	if(!l) {
+		return NULL;
+	}
+	l->size = size;
+	l->sub = sub;
+	mem_count(t, sub, (long)size);
+
+	return (char *)l + MEM_LARGE_HEADER;
+}
+
+void *
+rmalloc(size_t size) {
+
+	return mem_alloc(MEM_OTHER, size, 0);
+}
+
+void *
+rcalloc(size_t nmemb, size_t size) {
+
+	return mem_alloc(MEM_OTHER, nmemb * size, 1);
+}
+
+void *
+rmalloc_in(mem_subsystem sub, size_t size) {
+
+	return mem_alloc(sub, size, 0);
+}
+
+void *
+rcalloc_in(mem_subsystem sub, size_t nmemb, size_t size) {
+
+	return mem_alloc(sub, nmemb * size, 1);
 }
 
 char *
@@ -45,23 +229,115 @@ rstrdup(const char *s) {
 	char *ret;
 	size_t sz = strlen(s);
 
-	ret = rcalloc(sz + 1, 1);
-	memcpy(ret, s, sz);
+	ret = rmalloc(sz + 1);
+	memcpy(ret, s, sz + 1);
 
 	return ret;
 }
 
+/**
+ * Free a block from any thread, it goes back to the pool it came from.
+ */
 void
 rfree(void *ptr) {
 
-	size_t sz;
+	struct mem_thread *t;
+	struct mem_span *span;
+	struct mem_pool *pool;
+	struct mem_block *b = ptr, *head;
+	struct mem_large *l;
+
 	if(!ptr) {
 		return;
 	}
+	t = mem_thread();
 
-	memcpy(&sz, ptr - HEADER_SIZE, HEADER_SIZE);
-	cur_memory -= sz;
+	if((char *)ptr >= __region && (char *)ptr < __region + __region_size) {
+		span = (struct mem_span *)((uintptr_t)ptr & ~(uintptr_t)(MEM_SPAN - 1));
+		pool = span->pool;
+		if(t) {
+			mem_count(t, span->sub, -(long)__classes[span->cls]);
+		}
+		if(t && pool == &t->pools[span->sub][span->cls]) {
+			b->next = pool->free;
+			pool->free = b;
+		} else { /* only the owner empties its list */
+			do {
+				head = pool->remote;
+				b->next = head;
+			} while(!__sync_bool_compare_and_swap(&pool->remote, head, b));
+		}
+		return;
+	}
 
-	free(ptr-HEADER_SIZE);
+	l = (struct mem_large *)((char *)ptr - MEM_LARGE_HEADER);
+	if(t) {
+		mem_count(t, l->sub, -(long)l->size);
+	}
+	free(l);
 }
 
+/**
+ * Bytes allocated by a subsystem, in all the threads.
+ */
+size_t
+mem_used(mem_subsystem sub) {
+
+	struct mem_thread *t;
+	long total = 0;
+
+	pthread_mutex_lock(&__threads_lock);
+	for(t = __threads; t; t = t->next) {
+		total += __atomic_load_n(&t->used[sub], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&__threads_lock);
+
+	return total > 0 ? (size_t)total : 0;
+}
+
+/**
+ * Bytes allocated by a subsystem in the current thread, less what it freed:
+ * the difference between two calls is what the thread did in between.
+ */
+long
+mem_used_here(mem_subsystem sub) {
+
+	struct mem_thread *t = mem_thread();
+
+	return t ? t->used[sub] : 0;
+}
+
+size_t
+mem_total() {
+
+	size_t total = 0;
+	int sub;
+
+	for(sub = 0; sub < MEM_SUBSYSTEMS; ++sub) {
+		total += mem_used((mem_subsystem)sub);
+	}
+	return total;
+}
+
+/**
+ * Bytes of spans in use, free blocks included.
+ */
+size_t
+mem_reserved() {
+
+	size_t spans = __region_next;
+
+	return spans < __region_size ? spans : __region_size;
+}
+
+int
+mem_over_limit() {
+
+	return max_memory && mem_total() > max_memory;
+}
+
+const char *
+mem_subsystem_name(mem_subsystem sub) {
+
+	return __names[sub];
+}
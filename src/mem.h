@@ -3,6 +3,27 @@
 
 #include <stdlib.h>
 
+/*
+ * Blocks up to MEM_SMALL_MAX bytes come from per-thread pools, one per size
+ * class and subsystem, carved from spans of MEM_SPAN bytes in a reserved
+ * address range: the span header gives the size of a block, which needs no
+ * header of its own. Larger blocks are allocated with malloc behind a small
+ * header. Usage is counted per subsystem, for `/stats' and max_memory.
+ */
+
+#define MEM_SPAN	(64*1024)
+#define MEM_SMALL_MAX	4096
+
+typedef enum {
+	MEM_OTHER = 0,
+	MEM_CHANNELS,		/* channels, their table and names */
+	MEM_HISTORY,		/* messages kept for catch-up */
+	MEM_CONNECTIONS,	/* connections, subscribers, requests */
+	MEM_BUFFERS,		/* messages in flight, output and input */
+	MEM_SUBSYSTEMS
+} mem_subsystem;
+
+/* bytes, 0 for no limit */
 extern size_t max_memory;
 
 void *
@@ -11,10 +32,34 @@ rmalloc(size_t size);
 void *
 rcalloc(size_t nmemb, size_t size);
 
+void *
+rmalloc_in(mem_subsystem sub, size_t size);
+
+void *
+rcalloc_in(mem_subsystem sub, size_t nmemb, size_t size);
+
 char *
 rstrdup(const char *s);
 
 void
 rfree(void *ptr);
 
+size_t
+mem_used(mem_subsystem sub);
+
+long
+mem_used_here(mem_subsystem sub);
+
+size_t
+mem_total();
+
+size_t
+mem_reserved();
+
+int
+mem_over_limit();
+
+const char *
+mem_subsystem_name(mem_subsystem sub);
+
 #endif
@@ -0,0 +1,341 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "output.h"
+#include "socket.h"
+#include "channel.h"
+#include "server.h"
+#include "conf.h"
+#include "mem.h"
+
+/* max number of items written by a single writev */
+#define OUTPUT_IOV_MAX	64
+
+static void
+on_writable(int fd, short event, void *ptr);
+
+static void
+output_arm(struct connection *cx) {
+
+	struct output *out = &cx->out;
+
+	if(out->armed) {
+		return;
+	}
+	if(!out->ev) {
+		out->ev = rmalloc_in(MEM_BUFFERS, sizeof(struct event));
+	}
+	event_set(out->ev, cx->fd, EV_WRITE, on_writable, cx);
+	event_base_set(cx->base, out->ev);
+	event_add(out->ev, NULL);
+	out->armed = 1;
+}
+
+static void
+output_item_free(struct output_item *item) {
+
+	if(item->msg) {
+		channel_message_unref(item->msg);
+	}
+	rfree(item);
+}
+
+/**
+ * Append to the queue, by reference if there is a message to hold on to.
+ * The first `sent' bytes of a message are already out: the item is then
+ * in flight, and never dropped.
+ */
+static void
+output_append(struct connection *cx, struct channel_message *msg, const char *data,
+		size_t len, size_t sent) {
+
+	struct output *out = &cx->out;
+	struct output_item *item;
+
+	if(msg) {
+		item = rcalloc_in(MEM_BUFFERS, 1, sizeof(struct output_item));
+		item->msg = msg;
+		channel_message_ref(msg);
+		item->data = data;
+		item->sent = sent;
+	} else { /* copy, of what was not sent */
+		data += sent;
+		len -= sent;
+		item = rcalloc_in(MEM_BUFFERS, 1, sizeof(struct output_item) + len);
+		memcpy(item + 1, data, len);
+		item->data = (const char*)(item + 1);
+	}
+	item->len = len;
+
+	if(out->tail) {
+		out->tail->next = item;
+	} else {
+		out->head = item;
+	}
+	out->tail = item;
+	out->bytes += len - item->sent;
+
+	if(out->bytes > (size_t)__cfg->output_high_watermark) {
+		out->congested = 1;
+	}
+	output_arm(cx);
+}
+
+/**
+ * Remove the messages nobody has started to send, oldest first,
+ * until we have at most `target' bytes in the queue.
+ */
+static void
+output_drop(struct output *out, size_t target) {
+
+	struct output_item *item, *prev = NULL, *next;
+
+	for(item = out->head; item && out->bytes > target; item = next) {
+		next = item->next;
+		if(!item->msg || item->sent) { /* keep: not a whole message. */
+			prev = item;
+			continue;
+		}
+		if(prev) {
+			prev->next = next;
+		} else {
+			out->head = next;
+		}
+		if(out->tail == item) {
+			out->tail = prev;
+		}
+		out->bytes -= item->len;
+		output_item_free(item);
+	}
+}
+
+/**
+ * Write as much as we can from an iovec, return how much was written.
+ * A write error marks the connection as broken and returns -1.
+ */
+static int
+output_try(struct connection *cx, const struct iovec *iov, int iov_count) {
+
+	int ret = writev(cx->fd, iov, iov_count > IOV_MAX ? IOV_MAX : iov_count);
+
+	if(ret < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		cx->out.broken = 1;
+		return -1;
+	}
+	cx->out.written += ret;
+	return ret;
+}
+
+/**
+ * Queue iovecs after a possibly partial write, copying the unsent data.
+ */
+static void
+output_append_iov(struct connection *cx, const struct iovec *iov, int iov_count, size_t skip) {
+
+	int i;
+	for(i = 0; i < iov_count; ++i) {
+		if(skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		output_append(cx, NULL, (const char*)iov[i].iov_base, iov[i].iov_len, skip);
+		skip = 0;
+	}
+}
+
+/**
+ * Write data to a client, queueing what could not be sent right away.
+ * Returns the length, or -1 if the connection is broken.
+ */
+int
+output_writev(struct connection *cx, const struct iovec *iov, int iov_count) {
+
+	int i, ret = 0;
+	size_t total = 0;
+
+	for(i = 0; i < iov_count; ++i) {
+		total += iov[i].iov_len;
+	}
+	if(cx->out.broken) {
+		return -1;
+	}
+
+	/* nothing waiting: try to write directly. */
+	if(!cx->out.head && (ret = output_try(cx, iov, iov_count)) < 0) {
+		return -1;
+	}
+	if((size_t)ret < total) {
+		output_append_iov(cx, iov, iov_count, (size_t)ret);
+	}
+	return (int)total;
+}
+
+int
+output_write(struct connection *cx, const char *data, size_t len) {
+
+	struct iovec iov;
+
+	iov.iov_base = (void*)data;
+	iov.iov_len = len;
+
+	return output_writev(cx, &iov, 1);
+}
+
+/**
+ * Write a channel message. When it has to wait, the queue keeps a reference
+ * to the message instead of a copy, and the slow consumer policy applies.
+ */
+int
+output_write_msg(struct connection *cx, struct channel_message *msg,
+		const char *data, size_t len, slow_policy policy) {
+
+	struct iovec iov;
+
+	iov.iov_base = (void*)data;
+	iov.iov_len = len;
+
+	return output_write_msgs(cx, &msg, &iov, 1, policy);
+}
+
+/**
+ * Write several channel messages at once, iov[i] being the encoding of msgs[i].
+ */
+int
+output_write_msgs(struct connection *cx, struct channel_message **msgs,
+		const struct iovec *iov, int count, slow_policy policy) {
+
+	struct output *out = &cx->out;
+	size_t total = 0, skip;
+	int i, ret = 0;
+
+	if(out->broken) {
+		return -1;
+	}
+
+	if(out->congested) {
+		switch(policy) {
+			case SLOW_DISCONNECT:
+				out->broken = 1;
+				return -1;
+
+			case SLOW_DROP: /* make room for the new message */
+				output_drop(out, (size_t)__cfg->output_low_watermark);
+				break;
+
+			case SLOW_COALESCE: /* the latest message replaces all the others */
+				output_drop(out, 0);
+				break;
+		}
+	}
+
+	if(!out->head && (ret = output_try(cx, iov, count)) < 0) {
+		return -1;
+	}
+	for(i = 0, skip = (size_t)ret; i < count; ++i) {
+		total += iov[i].iov_len;
+		if(skip >= iov[i].iov_len) { /* sent */
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		output_append(cx, msgs[i], (const char*)iov[i].iov_base,
+				iov[i].iov_len, skip);
+		skip = 0;
+	}
+	return (int)total;
+}
+
+int
+output_pending(struct connection *cx) {
+	return cx->out.head != NULL;
+}
+
+/**
+ * Make sure the output is looked at from the event loop, even if empty.
+ */
+void
+output_flush(struct connection *cx) {
+	output_arm(cx);
+}
+
+/**
+ * Drain the queue, with as few writes as possible.
+ */
+static void
+on_writable(int fd, short event, void *ptr) {
+	(void)fd;
+	(void)event;
+
+	struct connection *cx = ptr;
+	struct output *out = &cx->out;
+	struct output_item *item;
+	struct iovec iov[OUTPUT_IOV_MAX];
+	int i, ret = 0;
+
+	out->armed = 0;
+
+	if(out->broken) {
+		cx_remove(cx);
+		return;
+	}
+
+	for(i = 0, item = out->head; item && i < OUTPUT_IOV_MAX; item = item->next, ++i) {
+		iov[i].iov_base = (void*)(item->data + item->sent);
+		iov[i].iov_len = item->len - item->sent;
+	}
+
+	if(i && (ret = output_try(cx, iov, i)) < 0) {
+		cx_remove(cx);
+		return;
+	}
+
+	/* release what was sent */
+	out->bytes -= ret;
+	while((item = out->head) && (size_t)ret >= item->len - item->sent) {
+		ret -= item->len - item->sent;
+		out->head = item->next;
+		output_item_free(item);
+	}
+	if(item) {
+		item->sent += ret;
+	} else {
+		out->tail = NULL;
+	}
+
+	if(out->bytes <= (size_t)__cfg->output_low_watermark) {
+		out->congested = 0;
+	}
+
+	if(out->head) {
+		output_arm(cx);
+	} else if(cx->closing) { /* was only waiting for the queue to drain */
+		cx_remove(cx);
+	} else if(cx->handoff) { /* same, to move to another worker */
+		server_handoff(cx);
+	}
+}
+
+void
+output_free(struct connection *cx) {
+
+	struct output_item *item, *next;
+
+	for(item = cx->out.head; item; item = next) {
+		next = item->next;
+		output_item_free(item);
+	}
+	cx->out.head = cx->out.tail = NULL;
+	cx->out.bytes = 0;
+
+	if(cx->out.ev) {
+		if(cx->out.armed) {
+			event_del(cx->out.ev);
+		}
+		rfree(cx->out.ev);
+		cx->out.ev = NULL;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "conf.h"
+
+/* max number of buffers in a single writev */
+#ifndef IOV_MAX
+#define IOV_MAX	1024
+#endif
+
+struct event;
+struct connection;
+struct channel_message;
+
+/* data waiting to be written to a client */
+struct output_item {
+	const char *data;
+	size_t len;
+	size_t sent;
+
+	/* reference keeping `data' alive; NULL if the data follows the item. */
+	struct channel_message *msg;
+
+	struct output_item *next;
+};
+
+struct output {
+	struct output_item *head;
+	struct output_item *tail;
+	size_t bytes; /* not sent yet */
+	size_t written; /* since the connection opened */
+
+	struct event *ev; /* EV_WRITE */
+	int armed;
+
+	int congested; /* went over the high watermark */
+	int broken; /* write error, nothing will ever get out */
+};
+
+int
+output_write(struct connection *cx, const char *data, size_t len);
+
+int
+output_writev(struct connection *cx, const struct iovec *iov, int iov_count);
+
+int
+output_write_msg(struct connection *cx, struct channel_message *msg,
+		const char *data, size_t len, slow_policy policy);
+
+int
+output_write_msgs(struct connection *cx, struct channel_message **msgs,
+		const struct iovec *iov, int count, slow_policy policy);
+
+int
+output_pending(struct connection *cx);
+
+void
+output_flush(struct connection *cx);
+
+void
+output_free(struct connection *cx);
+
+#endif /* OUTPUT_H */
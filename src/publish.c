@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <event.h>
+
+#include "publish.h"
+#include "worker.h"
+#include "socket.h"
+#include "output.h"
+#include "upgrade.h"
+#include "conf.h"
+#include "mem.h"
+
+struct publish_listener {
+	int fd;
+	struct event ev;
+};
+
+/* one TCP listener per worker, and the Unix socket on the first one. */
+static struct publish_listener *__listeners = NULL;
+static struct publish_listener __listener_unix;
+
+static void
+publish_listen(struct publish_listener *l, struct worker *w) {
+
+	event_set(&l->ev, l->fd, EV_READ | EV_PERSIST, on_publish_accept, w->base);
+	event_base_set(w->base, &l->ev);
+	event_add(&l->ev, NULL);
+}
+
+/**
+ * Open the listeners configured in river.conf, must run after worker_init.
+ */
+int
+publish_init(struct conf *cfg) {
+
+	int i;
+
+	if(cfg->publish_port) {
+		__listeners = rcalloc(worker_count(), sizeof(struct publish_listener));
+		for(i = 0; i < worker_count(); ++i) {
+			if((__listeners[i].fd = upgrade_take(UPGRADE_PUBLISH, i)) == -1
+				&& (__listeners[i].fd = socket_setup(cfg->ip, cfg->publish_port)) == -1) {
+				return -1;
+			}
+			publish_listen(&__listeners[i], worker_get(i));
+		}
+	}
+
+	if(cfg->publish_socket) {
+		if((__listener_unix.fd = upgrade_take(UPGRADE_PUBLISH_UNIX, 0)) == -1
+			&& (__listener_unix.fd = socket_setup_unix(cfg->publish_socket, 0)) == -1) {
+			return -1;
+		}
+		publish_listen(&__listener_unix, worker_get(0));
+	}
+
+	return 0;
+}
+
+/**
+ * Stop accepting in a worker, the sockets stay open.
+ */
+void
+publish_stop(struct worker *w) {
+
+	if(__listeners) {
+		event_del(&__listeners[w->id].ev);
+	}
+	if(w->id == 0 && __cfg && __cfg->publish_socket) {
+		event_del(&__listener_unix.ev);
+	}
+}
+
+/**
+ * Listening sockets, for an upgrade. -1 if there is none.
+ */
+int
+publish_listener(int i) {
+
+	return __listeners && i < worker_count() ? __listeners[i].fd : -1;
+}
+
+int
+publish_listener_unix() {
+
+	return __cfg && __cfg->publish_socket ? __listener_unix.fd : -1;
+}
+
+void
+on_publish_accept(int fd, short event, void *ptr) {
+	(void)event;
+
+	struct event_base *base = ptr;
+	struct connection *cx;
+	int client_fd;
+
+	client_fd = accept(fd, NULL, NULL);
+	if(client_fd == -1) {
+		return;
+	}
+	fcntl(client_fd, F_SETFL, O_NONBLOCK);
+
+	if(!(cx = cx_new(client_fd, base))) { /* too many connections */
+		close(client_fd);
+		return;
+	}
+	cx->state = CX_PUBLISHING_BINARY;
+
+	event_set(&cx->ev, cx->fd, EV_READ | EV_PERSIST, on_publish_data, cx);
+	event_base_set(base, &cx->ev);
+	event_add(&cx->ev, NULL);
+}
+
+/**
+ * Publish every complete request in data.
+ * Returns the number of bytes used, or -1 if a request is malformed.
+ */
+static int
+publish_parse(const char *data, size_t len, uint32_t *count) {
+
+	const unsigned char *p;
+	size_t pos = 0, name_len, data_len;
+
+	while(len - pos >= PUBLISH_HEADER_SIZE) {
+		p = (const unsigned char *)data + pos;
+
+		name_len = (p[1] << 8) | p[2];
+		data_len = ((size_t)p[3] << 24) | (p[4] << 16) | (p[5] << 8) | p[6];
+
+		if(p[0] != PUBLISH_OP_PUBLISH || !name_len || name_len > PUBLISH_MAX_NAME
+				|| data_len > PUBLISH_MAX_FRAME) {
+			return -1;
+		}
+		if(len - pos < PUBLISH_HEADER_SIZE + name_len + data_len) { /* partial */
+			break;
+		}
+
+		worker_publish((const char *)p + PUBLISH_HEADER_SIZE, name_len,
+				(const char *)p + PUBLISH_HEADER_SIZE + name_len, data_len);
+
+		pos += PUBLISH_HEADER_SIZE + name_len + data_len;
+		(*count)++;
+	}
+
+	return (int)pos;
+}
+
+void
+on_publish_data(int fd, short event, void *ptr) {
+	(void)fd;
+	(void)event;
+
+	struct connection *cx = ptr;
+	char *buffer, ack[5];
+	uint32_t count = 0;
+	int nb_read, used;
+
+	nb_read = cx_read(cx, &buffer);
+	if(nb_read < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if(nb_read <= 0) {
+		cx_remove(cx);
+		return;
+	}
+
+	used = publish_parse(buffer, (size_t)nb_read, &count);
+
+	/* one acknowledgement per read */
+	if(count) {
+		ack[0] = PUBLISH_OP_ACK;
+		count = htonl(count);
+		memcpy(ack + 1, &count, sizeof(count));
+		if(output_write(cx, ack, sizeof(ack)) < 0) {
+			cx_remove(cx);
+			return;
+		}
+	}
+
+	if(used < 0 || cx_keep(cx, buffer + used, nb_read - used) < 0) {
+		cx_remove(cx);
+	}
+}
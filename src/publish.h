@@ -0,0 +1,45 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+/*
+ * Binary publish protocol, for application servers.
+ *
+ * Request, all integers in network byte order:
+ *	'P' | name length (16 bits) | data length (32 bits) | name | data
+ *
+ * Requests can be pipelined. After each read, the server acknowledges
+ * the messages it accepted with:
+ *	'A' | count (32 bits)
+ *
+ * Any malformed request closes the connection.
+ */
+
+#define PUBLISH_OP_PUBLISH	'P'
+#define PUBLISH_OP_ACK		'A'
+
+#define PUBLISH_HEADER_SIZE	7
+#define PUBLISH_MAX_NAME	1024
+#define PUBLISH_MAX_FRAME	(512*1024)
+
+struct conf;
+struct worker;
+
+int
+publish_init(struct conf *cfg);
+
+void
+publish_stop(struct worker *w);
+
+int
+publish_listener(int i);
+
+int
+publish_listener_unix();
+
+void
+on_publish_accept(int fd, short event, void *ptr);
+
+void
+on_publish_data(int fd, short event, void *ptr);
+
+#endif
@@ -0,0 +1,76 @@
+#include <string.h>
+
+#include "ring.h"
+#include "mem.h"
+
+/**
+ * Creates a ring holding up to `size' elements, rounded to a power of two.
+ */
+struct ring *
+ring_new(unsigned int size, size_t elem_size) {
+
+	struct ring *r;
+	unsigned int n = 2;
+
+	while(n < size) {
+		n <<= 1;
+	}
+
+	r = rcalloc(1, sizeof(struct ring));
+	r->mask = n - 1;
+	r->elem_size = elem_size;
+	r->elems = rcalloc(n, elem_size);
+
+	return r;
+}
+
+void
+ring_free(struct ring *r) {
+
+	if(!r) {
+		return;
+	}
+	rfree(r->elems);
+	rfree(r);
+}
+
+/**
+ * Producer side: copy an element in the ring. Returns -1 if the ring is full.
+ */
+int
+ring_push(struct ring *r, const void *elem) {
+
+	unsigned int tail = r->tail; /* only written by us */
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if(tail - head > r->mask) { /* full */
+		return -1;
+	}
+
+	memcpy(r->elems + (tail & r->mask) * r->elem_size, elem, r->elem_size);
+
+	/* publish the element */
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Consumer side: copy the oldest element out of the ring.
+ * Returns -1 if the ring is empty.
+ */
+int
+ring_pop(struct ring *r, void *elem) {
+
+	unsigned int head = r->head; /* only written by us */
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if(head == tail) { /* empty */
+		return -1;
+	}
+
+	memcpy(elem, r->elems + (head & r->mask) * r->elem_size, r->elem_size);
+
+	/* release the slot */
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdlib.h>
+
+#define RING_CACHE_LINE	64
+
+/**
+ * Bounded single-producer, single-consumer queue of fixed-size elements.
+ * Exactly one thread may push and one thread may pop; no lock is taken.
+ */
+struct ring {
+	/* written by the consumer */
+	unsigned int head __attribute__((aligned(RING_CACHE_LINE)));
+
+	/* written by the producer */
+	unsigned int tail __attribute__((aligned(RING_CACHE_LINE)));
+
+	unsigned int mask __attribute__((aligned(RING_CACHE_LINE)));
+	size_t elem_size;
+	char *elems;
+};
+
+struct ring *
+ring_new(unsigned int size, size_t elem_size);
+
+void
+ring_free(struct ring *r);
+
+int
+ring_push(struct ring *r, const void *elem);
+
+int
+ring_pop(struct ring *r, void *elem);
+
+#endif /* RING_H */
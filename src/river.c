@@ -23,6 +23,7 @@ main(int argc, char *argv[]) {
 		fprintf(stderr, "Could not read config file.\n");
 		return EXIT_FAILURE;
 	}
+	__cfg = cfg;
 
 	char *s = rmalloc(11);
 	memcpy(s, "0123456789", 10);
@@ -32,10 +33,10 @@ main(int argc, char *argv[]) {
 	/* initialize syslog */
 	openlog(cfg->log_file, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_USER);
 
-	int fd = socket_setup(cfg->ip, cfg->port);
-	channel_init();
-
-	server_run(fd, cfg->max_connections);
+	if(server_run(cfg) != 0) {
+		fprintf(stderr, "Could not start the server.\n");
+		return EXIT_FAILURE;
+	}
 	printf("bye\n");
 
 	return EXIT_SUCCESS;
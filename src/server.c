@@ -4,18 +4,84 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "server.h"
+#include "worker.h"
+#include "conf.h"
 #include "channel.h"
 #include "socket.h"
 #include "http_dispatch.h"
 #include "websocket.h"
+#include "output.h"
+#include "publish.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "upgrade.h"
+#include "deadline.h"
 #include "mem.h"
 
 extern char flash_xd[];
 extern int flash_xd_len;
 
-#define CHANNEL_CLEANUP_TIMER	1
+/* returned by on_client_data when another worker took the connection. */
+#define CX_HANDED_OFF	2
+
+static int
+on_client_action(http_action action) {
+
+	switch(action) {
+		case HTTP_DISCONNECT:
+			return -1;
+
+		case HTTP_KEEP_CONNECTED:
+			return 1;
+
+		case HTTP_KEEP_ALIVE:
+			return 1;
+
+		case HTTP_WEBSOCKET_MONITOR:
+			return 1;
+
+		case HTTP_HANDOFF:
+			return CX_HANDED_OFF;
+
+		default:
+			return -1;
+	}
+}
+
+static const http_parser_settings settings = {
+	.on_path = http_parser_onpath,
+	.on_url = http_parser_onurl,
+	.on_body = http_parser_onbody,
+	.on_header_field = http_parser_on_header_field,
+	.on_header_value = http_parser_on_header_value,
+	.on_message_complete = http_parser_on_message_complete
+};
+
+static int
+server_parse(struct connection *cx, char *buffer, int nb_read);
+
+/**
+ * Move a connection to the worker set in cx->handoff, once nothing is left
+ * to write from here: its events and timers belong to this worker.
+ */
+void
+server_handoff(struct connection *cx) {
+
+	struct worker *w = cx->handoff;
+
+	if(cx->out.armed) {
+		event_del(cx->out.ev);
+		cx->out.armed = 0;
+	}
+	deadline_stop(cx);
+	cx->handoff = NULL;
+	worker_handoff(w, cx);
+}
 
 /**
  * Got client data on a connection.
@@ -24,11 +90,7 @@ int
 on_client_data(struct connection *cx) {
 
 	int nb_read;
-	http_parser parser;
-	http_parser_settings settings;
-	http_action action;
-
-	char buffer[64*1024]; 
+	char *buffer;
 
 	if(cx->state == CX_CONNECTED_WEBSOCKET) { /* already connected WS */
 		if(ws_client_msg(cx) == 0) {
@@ -38,63 +100,140 @@ on_client_data(struct connection *cx) {
 		}
 	}
 
-	memset(buffer, 0, sizeof(buffer));
-	nb_read = read(cx->fd, buffer, sizeof(buffer));
+	nb_read = cx_read(cx, &buffer);
+	if(nb_read < 0 && (errno == EAGAIN || errno == EINTR)) { /* nothing yet */
+		return 1;
+	}
 	if(nb_read <= 0) {
 		return nb_read;
 	}
 
-	/* got data, setup http parser */
-	memset(&settings, 0, sizeof(http_parser_settings));
-	parser.flags = 0;
-	settings.on_path = http_parser_onpath;
-	settings.on_url = http_parser_onurl;
-	settings.on_body = http_parser_onbody;
-	settings.on_header_field = http_parser_on_header_field;
-	settings.on_header_value = http_parser_on_header_value;
-
-	if(nb_read == 23 &&
+	if(!cx->parsing && nb_read == 23 &&
 		memcmp(buffer, "<policy-file-request/>", 23) == 0) {
-		int ret = write(cx->fd, flash_xd, flash_xd_len-1);
+		int ret = output_write(cx, flash_xd, flash_xd_len-1);
 		(void)ret;
-		action = HTTP_DISCONNECT;
-	} else {
-		/* parse data using @ry’s http-parser library.
-		 * → http://github.com/ry/http-parser/
-		 */
-		http_parser_init(&parser, HTTP_REQUEST);
-		parser.data = cx;
-		int nb_parsed = http_parser_execute(&parser, &settings, buffer, nb_read);
-
-		if(nb_parsed  < nb_read) {
-			size_t post_len = nb_read - nb_parsed - 1;
-
-			cx->post_len = (int)post_len;
-			cx->post = rcalloc(post_len, 1);
-			memcpy(cx->post, buffer + nb_parsed + 1, post_len);
+		return on_client_action(HTTP_DISCONNECT);
+	}
+
+	return server_parse(cx, buffer, nb_read);
+}
+
+/**
+ * Parse and dispatch the requests in a buffer, keeping what is left
+ * of it for later.
+ */
+static int
+server_parse(struct connection *cx, char *buffer, int nb_read) {
+
+	int pos = 0;
+	http_action action;
+
+	/* parse data using @ry’s http-parser library.
+	 * → http://github.com/ry/http-parser/
+	 *
+	 * The parser keeps its state in the connection, so a request
+	 * can arrive over several reads. It stops after each request,
+	 * so that pipelined requests are dispatched one by one.
+	 */
+	while(pos < nb_read) {
+
+		int nb_parsed;
+
+		if(!cx->parsing || cx->request_done) {
+			cx->request_done = 0;
+			http_parser_init(&cx->parser, HTTP_REQUEST);
+			cx->parser.data = cx;
+			cx->parsing = 1;
 		}
+		nb_parsed = http_parser_execute(&cx->parser, &settings, buffer + pos, nb_read - pos);
 
-		if(!nb_parsed) {
+		if(cx->state == CX_BROKEN) { /* request too large */
 			return -1;
-		} else {
-			/* dispatch the client depending on the URL path */
-			action = http_dispatch(cx);
 		}
+
+		if(!cx->request_done && !cx->parser.upgrade) {
+			if(nb_parsed < nb_read - pos) { /* parse error */
+				return -1;
+			}
+			pos = nb_read; /* incomplete, wait for more data. */
+			break;
+		}
+
+		pos += nb_parsed + 1;
+		if(cx->parser.upgrade) { /* the rest is not HTTP */
+			cx->post_len = nb_read - pos;
+			if(!(cx->post = arena_alloc(&cx->arena, cx->post_len))) {
+				return -1;
+			}
+			memcpy(cx->post, buffer + pos, cx->post_len);
+			pos = nb_read;
+		}
+
+		/* dispatch the client depending on the URL path */
+		action = http_dispatch(cx);
+
+		if(action == HTTP_HANDOFF) { /* bring the rest along */
+			if(cx_keep(cx, buffer + pos, nb_read - pos) < 0) {
+				return -1;
+			}
+			if(!output_pending(cx)) {
+				server_handoff(cx);
+			} /* else once the replies to the previous requests are out. */
+			return CX_HANDED_OFF;
+		}
+		if(action != HTTP_KEEP_ALIVE) {
+			if(cx->state != CX_CONNECTED_WEBSOCKET /* it kept its own */
+				&& cx_keep(cx, buffer + pos, nb_read - pos) < 0) {
+				return -1;
+			}
+			return on_client_action(action);
+		}
+
+		/* ready for the next request */
+		cx_reset(cx);
+		deadline_request(cx);
 	}
 
-	switch(action) {
-		case HTTP_DISCONNECT:
-			return -1;
+	return cx_keep(cx, buffer + pos, nb_read - pos) < 0 ? -1 : 1;
+}
 
-		case HTTP_KEEP_CONNECTED:
-			return 1;
+/**
+ * Start or stop monitoring a connection, depending on what the last
+ * callback returned.
+ */
+static void
+server_monitor(struct connection *cx, int ret) {
 
-		case HTTP_WEBSOCKET_MONITOR:
-			return 1;
+	if(ret == CX_HANDED_OFF) { /* not ours anymore */
+		return;
+	}
+	if(ret <= 0) {
+		cx_remove(cx);
+	} else if(!cx->closing) {
+		/* start monitoring the connection */
+		event_set(&cx->ev, cx->fd, EV_READ, on_available_data, cx);
+		event_base_set(cx->base, &cx->ev);
+		event_add(&cx->ev, NULL);
+	}
+}
 
-		default:
-			return -1;
+/**
+ * Dispatch a connection which has been parsed by another worker.
+ */
+void
+server_dispatch(struct connection *cx) {
+
+	http_action action = http_dispatch(cx);
+	int ret;
+
+	if(action == HTTP_KEEP_ALIVE) { /* the next requests came along */
+		cx_reset(cx);
+		deadline_request(cx);
+		ret = cx->in_len ? server_parse(cx, cx->in, (int)cx->in_len) : 1;
+	} else {
+		ret = on_client_action(action);
 	}
+	server_monitor(cx, ret);
 }
 
 /* Called to clean empty channels. */
@@ -104,11 +243,20 @@ on_channel_cleanup(int fd, short event, void *ptr) {
 	(void)fd;
 	(void)event;
 	struct cleanup_timer *ct = ptr;
+	struct timeval now = {0, 0};
 
-	channel_clean_idle();
+	/* messages past their max age, then histories if over max_memory. */
+	channel_expire();
+	channel_evict();
 
-	/* re-add the timer */
-	cleanup_reset(ct);
+	/* re-add the timer, right away if there are more to free. */
+	if(channel_clean_idle()) {
+		evtimer_set(&ct->ev, on_channel_cleanup, ct);
+		event_base_set(ct->base, &ct->ev);
+		event_add(&ct->ev, &now);
+	} else {
+		cleanup_reset(ct);
+	}
 }
 
 void
@@ -118,35 +266,84 @@ cleanup_reset(struct cleanup_timer *ct) {
 	event_add(&ct->ev, &ct->tv);
 }
 
-void
-server_run(int fd, int max_connections) {
+/* signals are handled by the first worker */
+static struct event __ev_snapshot;
+static struct event __ev_int;
+static struct event __ev_term;
 
-	extern int server_max_cx; /* counting max number of connections */
-	struct event ev;
-	struct event_base *base = event_base_new();
+static void
+on_signal(int sig, short event, void *ptr) {
+	(void)event;
+	(void)ptr;
+
+	worker_broadcast(sig == SIGUSR1 ? CMD_SNAPSHOT : CMD_STOP);
+}
 
-	struct cleanup_timer ct;
-	ct.base = base;
-	ct.tv.tv_sec = CHANNEL_CLEANUP_TIMER;
-	ct.tv.tv_usec = 0;
+static void
+server_signal(struct event *ev, int sig, struct event_base *base) {
+
+	signal_set(ev, sig, on_signal, NULL);
+	event_base_set(base, ev);
+	signal_add(ev, NULL);
+}
+
+static void *
+server_worker_main(void *ptr) {
+
+	worker_run(ptr);
+	return NULL;
+}
+
+int
+server_run(struct conf *cfg) {
+
+	extern int server_max_cx; /* counting max number of connections */
+	int i;
 
 	/* global connection limiter */
-	server_max_cx = max_connections;
+	server_max_cx = cfg->max_connections;
+	max_memory = cfg->max_memory;
 
 	/* ignore sigpipe */
 #ifdef SIGPIPE
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	event_set(&ev, fd, EV_READ | EV_PERSIST, on_possible_accept, base);
-	event_base_set(base, &ev);
-	event_add(&ev, NULL);
+	/* take the sockets of the server we replace, if any */
+	if(upgrade_connect(cfg) != 0) {
+		return -1;
+	}
+	if(worker_init(cfg->threads, cfg->ip, cfg->port) != 0) {
+		return -1;
+	}
+	if(publish_init(cfg) != 0) {
+		return -1;
+	}
+	if(upgrade_receive() != 0 || upgrade_listen(cfg) != 0) {
+		return -1;
+	}
+	if(journal_init(cfg, worker_count()) != 0) {
+		return -1;
+	}
+	snapshot_init(cfg);
 
-	cleanup_reset(&ct);
+	/* save the channels on SIGUSR1, and before leaving. */
+	server_signal(&__ev_snapshot, SIGUSR1, worker_get(0)->base);
+	server_signal(&__ev_int, SIGINT, worker_get(0)->base);
+	server_signal(&__ev_term, SIGTERM, worker_get(0)->base);
 
-	event_base_dispatch(base);
-}
+	/* the first worker runs in this thread */
+	for(i = 1; i < worker_count(); ++i) {
+		struct worker *w = worker_get(i);
+		pthread_create(&w->thread, NULL, server_worker_main, w);
+	}
+	worker_run(worker_get(0));
 
+	for(i = 1; i < worker_count(); ++i) {
+		pthread_join(worker_get(i)->thread, NULL);
+	}
+	return 0;
+}
 
 void
 on_possible_accept(int fd, short event, void *ptr) {
@@ -158,13 +355,20 @@ on_possible_accept(int fd, short event, void *ptr) {
 	int client_fd;
 
 	client_fd = accept(fd, (struct sockaddr*)&addr, &addr_sz);
+	if(client_fd == -1) {
+		return;
+	}
+	/* slow clients must never block the event loop. */
+	fcntl(client_fd, F_SETFL, O_NONBLOCK);
+
 	struct connection *cx = cx_new(client_fd, base);
 
 	if(cx) {
 		/* wait for new data */
-		event_set(cx->ev, cx->fd, EV_READ, on_available_data, cx);
-		event_base_set(base, cx->ev);
-		event_add(cx->ev, NULL);
+		event_set(&cx->ev, cx->fd, EV_READ, on_available_data, cx);
+		event_base_set(base, &cx->ev);
+		event_add(&cx->ev, NULL);
+		deadline_request(cx);
 	} else { /* too many connections */
 		close(client_fd);
 	}
@@ -172,18 +376,10 @@ on_possible_accept(int fd, short event, void *ptr) {
 
 void
 on_available_data(int fd, short event, void *ptr) {
+	(void)fd;
 	(void)event;
 
-	int ret;
 	struct connection *cx = ptr;
 
-	ret = on_client_data(cx);
-	if(ret <= 0) {
-		cx_remove(cx);
-	} else {
-		/* start monitoring the connection */
-		event_set(cx->ev, fd, EV_READ, on_available_data, cx);
-		event_base_set(cx->base, cx->ev);
-		event_add(cx->ev, NULL);
-	}
+	server_monitor(cx, on_client_data(cx));
 }
@@ -4,6 +4,8 @@
 #include <event.h>
 
 struct channel;
+struct connection;
+struct conf;
 
 struct cleanup_timer {
 	struct event ev;
@@ -11,8 +13,14 @@ struct cleanup_timer {
 	struct timeval tv;
 };
 
+int
+server_run(struct conf *cfg);
+
+void
+server_dispatch(struct connection *cx);
+
 void
-server_run(int fd, int max_connections);
+server_handoff(struct connection *cx);
 
 void
 cb_available_client_data(int fd, short event, void *ptr);
@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "sha1.h"
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block(sha1_state_t *s, const unsigned char *p) {
+
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for(i = 0; i < 16; ++i) { /* big endian */
+		w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16
+			| (uint32_t)p[4*i+2] << 8 | (uint32_t)p[4*i+3];
+	}
+	for(; i < 80; ++i) {
+		w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+	}
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3]; e = s->h[4];
+	for(i = 0; i < 80; ++i) {
+		if(i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if(i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if(i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d; s->h[4] += e;
+}
+
+void
+sha1_init(sha1_state_t *s) {
+
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xefcdab89;
+	s->h[2] = 0x98badcfe;
+	s->h[3] = 0x10325476;
+	s->h[4] = 0xc3d2e1f0;
+	s->count = 0;
+}
+
+void
+sha1_append(sha1_state_t *s, const unsigned char *data, size_t len) {
+
+	size_t used = s->count % 64, n;
+
+	s->count += len;
+	if(used) { /* complete the pending block first */
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(s->buf + used, data, n);
+		data += n;
+		len -= n;
+		if(used + n < 64) {
+			return;
+		}
+		sha1_block(s, s->buf);
+	}
+	for(; len >= 64; data += 64, len -= 64) {
+		sha1_block(s, data);
+	}
+	memcpy(s->buf, data, len);
+}
+
+void
+sha1_finish(sha1_state_t *s, unsigned char digest[SHA1_DIGEST_SIZE]) {
+
+	uint64_t bits = s->count * 8;
+	unsigned char pad[72] = {0x80};
+	unsigned char len[8];
+	size_t used = s->count % 64;
+	int i;
+
+	for(i = 0; i < 8; ++i) {
+		len[i] = (unsigned char)(bits >> (56 - 8 * i));
+	}
+	/* 0x80, zeros up to 56 bytes modulo 64, then the length in bits */
+	sha1_append(s, pad, used < 56 ? 56 - used : 120 - used);
+	sha1_append(s, len, 8);
+
+	for(i = 0; i < 20; ++i) {
+		digest[i] = (unsigned char)(s->h[i / 4] >> (24 - 8 * (i % 4)));
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* SHA-1 (RFC 3174), for the WebSocket handshake. */
+
+#define SHA1_DIGEST_SIZE	20
+
+typedef struct sha1_state_s {
+	uint32_t h[5];
+	uint64_t count;		/* bytes */
+	unsigned char buf[64];	/* accumulate block */
+} sha1_state_t;
+
+void
+sha1_init(sha1_state_t *s);
+
+void
+sha1_append(sha1_state_t *s, const unsigned char *data, size_t len);
+
+void
+sha1_finish(sha1_state_t *s, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+#endif /* SHA1_H */
@@ -0,0 +1,86 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "slab.h"
+#include "mem.h"
+
+/* the pool an object comes from is written right before it */
+struct slab_object {
+	struct slab *owner;
+	struct slab_object *next; /* first bytes of the object, while free */
+};
+
+#define SLAB_HEADER	offsetof(struct slab_object, next)
+#define SLAB_ALIGN	16
+
+static struct slab_object *
+slab_carve(struct slab *s) {
+
+	size_t size = (SLAB_HEADER + s->size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	struct slab_object *o;
+
+	if(s->chunk_left < size) {
+		/* the end of the previous chunk is lost, less than one object. */
+		if(!(s->chunk = rmalloc_in(s->sub, SLAB_CHUNK_SIZE > size ? SLAB_CHUNK_SIZE : size))) {
+			s->chunk_left = 0;
+			return NULL;
+		}
+		s->chunk_left = SLAB_CHUNK_SIZE > size ? SLAB_CHUNK_SIZE : size;
+		s->chunks++;
+	}
+	o = (struct slab_object *)s->chunk;
+	o->owner = s;
+	s->chunk += size;
+	s->chunk_left -= size;
+
+	return o;
+}
+
+/**
+ * A zeroed object from the pool of the current thread, NULL if out of memory.
+ */
+void *
+slab_alloc(struct slab *s) {
+
+	struct slab_object *o;
+
+	if(!s->free && s->remote) { /* take back everything at once */
+		s->free = __sync_lock_test_and_set(&s->remote, NULL);
+	}
+	if((o = s->free)) {
+		s->free = o->next;
+	} else if(!(o = slab_carve(s))) {
+		return NULL;
+	}
+	__sync_fetch_and_add(&s->used, 1);
+
+	memset((char *)o + SLAB_HEADER, 0, s->size);
+	return (char *)o + SLAB_HEADER;
+}
+
+/**
+ * Give an object back, `s' being the same pool in the current thread.
+ */
+void
+slab_free(struct slab *s, void *ptr) {
+
+	struct slab_object *o, *head;
+	struct slab *owner;
+
+	if(!ptr) {
+		return;
+	}
+	o = (struct slab_object *)((char *)ptr - SLAB_HEADER);
+	owner = o->owner;
+
+	if(owner == s) {
+		o->next = s->free;
+		s->free = o;
+	} else { /* the owner is the only one to empty its list */
+		do {
+			head = owner->remote;
+			o->next = head;
+		} while(!__sync_bool_compare_and_swap(&owner->remote, head, o));
+	}
+	__sync_fetch_and_sub(&owner->used, 1);
+}
@@ -0,0 +1,45 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdlib.h>
+
+#include "mem.h"
+
+/*
+ * Pools of fixed-size objects, declared `static __thread' so that every
+ * worker has its own:
+ *
+ *	static __thread struct slab __pool = SLAB_INITIALIZER(sizeof(struct x), MEM_OTHER);
+ *
+ * Objects are carved from chunks of SLAB_CHUNK_SIZE bytes, which are kept
+ * for the life of the process, and are recycled through a free list.
+ * An object freed by another worker goes back to the pool it came from.
+ */
+
+#define SLAB_CHUNK_SIZE	(64*1024)
+
+struct slab_object;
+
+struct slab {
+	size_t size;			/* objects, header included */
+
+	struct slab_object *free;	/* reused first */
+	struct slab_object *remote;	/* freed by other threads */
+
+	char *chunk;			/* being carved */
+	size_t chunk_left;
+
+	size_t used;			/* objects handed out */
+	size_t chunks;
+	mem_subsystem sub;		/* the chunks are counted there */
+};
+
+#define SLAB_INITIALIZER(sz, sub)	{(sz), NULL, NULL, NULL, 0, 0, 0, (sub)}
+
+void *
+slab_alloc(struct slab *s);
+
+void
+slab_free(struct slab *s, void *ptr);
+
+#endif /* SLAB_H */
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "channel.h"
+#include "history.h"
+#include "worker.h"
+#include "conf.h"
+#include "mem.h"
+
+static char *__path = NULL;
+static int __grace = 0;
+
+struct snapshot_writer {
+	FILE *f;
+	uint32_t count;
+	int error;
+};
+
+struct snapshot_reader {
+	const char *p;
+	const char *end;
+};
+
+int
+snapshot_init(struct conf *cfg) {
+
+	__path = cfg->snapshot;
+	__grace = cfg->snapshot_grace;
+	return 0;
+}
+
+static void
+snapshot_put(struct snapshot_writer *sw, const void *data, size_t len) {
+
+	if(fwrite(data, 1, len, sw->f) != len) {
+		sw->error = 1;
+	}
+}
+
+static void
+snapshot_channel(struct channel *channel, void *ptr) {
+
+	struct snapshot_writer *sw = ptr;
+	struct history *h = &channel->history;
+	struct history_entry *e;
+	uint32_t name_len = (uint32_t)channel->name_len, count, len;
+	uint64_t seq = channel->seq, time;
+	unsigned int i;
+
+	if(!channel->seq) { /* nothing to remember */
+		return;
+	}
+	history_expire(h, history_clock());
+	count = h->count;
+
+	snapshot_put(sw, &name_len, sizeof(name_len));
+	snapshot_put(sw, &count, sizeof(count));
+	snapshot_put(sw, &seq, sizeof(seq));
+	snapshot_put(sw, channel->name, name_len);
+
+	for(i = 0; i < count; ++i) {
+		e = history_get(h, i);
+		seq = e->seq;
+		time = history_to_epoch(e->time);
+		len = (uint32_t)e->len;
+		snapshot_put(sw, &seq, sizeof(seq));
+		snapshot_put(sw, &time, sizeof(time));
+		snapshot_put(sw, &len, sizeof(len));
+		snapshot_put(sw, h->arena + e->off, e->len);
+	}
+	sw->count++;
+}
+
+/**
+ * Save the channels of a worker, from its own thread.
+ * The file is replaced atomically, once it is on disk if `sync' is set.
+ */
+int
+snapshot_write(struct worker *w, int sync) {
+
+	struct snapshot_writer sw;
+	uint32_t magic = SNAPSHOT_MAGIC;
+	char path[1024], tmp[1024];
+	int i;
+
+	if(!__path) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "%s.%d", __path, w->id);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", __path, w->id);
+
+	memset(&sw, 0, sizeof(sw));
+	if(!(sw.f = fopen(tmp, "w"))) {
+		syslog(LOG_ERR, "can't write snapshot %s: %m\n", tmp);
+		return -1;
+	}
+	setvbuf(sw.f, NULL, _IOFBF, 1024*1024);
+
+	/* the count is known at the end. */
+	snapshot_put(&sw, &magic, sizeof(magic));
+	snapshot_put(&sw, &sw.count, sizeof(sw.count));
+	channel_foreach(snapshot_channel, &sw);
+	if(fseek(sw.f, sizeof(magic), SEEK_SET) == 0) {
+		snapshot_put(&sw, &sw.count, sizeof(sw.count));
+	} else {
+		sw.error = 1;
+	}
+
+	if(fflush(sw.f) != 0 || (sync && fsync(fileno(sw.f)) != 0)) {
+		sw.error = 1;
+	}
+	fclose(sw.f);
+	if(sw.error || rename(tmp, path) != 0) {
+		syslog(LOG_ERR, "can't write snapshot %s: %m\n", path);
+		unlink(tmp);
+		return -1;
+	}
+
+	/* files left by a run with more threads would be loaded again. */
+	if(w->id == 0) {
+		for(i = worker_count(); ; ++i) {
+			snprintf(path, sizeof(path), "%s.%d", __path, i);
+			if(unlink(path) != 0) {
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+snapshot_get(struct snapshot_reader *sr, void *out, size_t len) {
+
+	if((size_t)(sr->end - sr->p) < len) {
+		return -1;
+	}
+	if(out) {
+		memcpy(out, sr->p, len);
+	}
+	sr->p += len;
+	return 0;
+}
+
+/**
+ * Restore a channel owned by the current worker, unless the journal
+ * already brought it further. Returns NULL to skip its messages.
+ */
+static struct channel *
+snapshot_restore(const char *name, size_t name_len, unsigned long long seq) {
+
+	struct channel *channel;
+	char *tmp;
+
+	if(!(channel = channel_find(name, name_len))) {
+		tmp = rmalloc(name_len + 1);
+		memcpy(tmp, name, name_len);
+		tmp[name_len] = 0;
+		channel = channel_new(tmp);
+		rfree(tmp);
+		if(!channel) {
+			return NULL;
+		}
+	}
+	if(channel->seq >= seq) {
+		return NULL;
+	}
+	channel->seq = seq;
+	channel_history_free(channel);
+
+	/* give the subscribers some time to come back. */
+	channel_idle_delay(channel, __grace);
+
+	return channel;
+}
+
+static void
+snapshot_load_file(struct worker *w, const char *path) {
+
+	struct snapshot_reader sr;
+	struct channel *channel;
+	struct stat st;
+	uint32_t magic, count, name_len, msg_count, len;
+	uint64_t seq, time;
+	const char *name, *data;
+	char *base;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) == -1) {
+		return;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size == 0
+		|| (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	sr.p = base;
+	sr.end = base + st.st_size;
+
+	if(snapshot_get(&sr, &magic, sizeof(magic)) != 0 || magic != SNAPSHOT_MAGIC
+		|| snapshot_get(&sr, &count, sizeof(count)) != 0) {
+		syslog(LOG_ERR, "invalid snapshot %s\n", path);
+		count = 0;
+	}
+
+	while(count--) {
+		if(snapshot_get(&sr, &name_len, sizeof(name_len)) != 0
+			|| snapshot_get(&sr, &msg_count, sizeof(msg_count)) != 0
+			|| snapshot_get(&sr, &seq, sizeof(seq)) != 0) {
+			break;
+		}
+		name = sr.p;
+		if(snapshot_get(&sr, NULL, name_len) != 0) {
+			break;
+		}
+		channel = NULL;
+		if(worker_owner(name, name_len) == w) {
+			channel = snapshot_restore(name, name_len, seq);
+		}
+
+		while(msg_count--) {
+			if(snapshot_get(&sr, &seq, sizeof(seq)) != 0
+				|| snapshot_get(&sr, &time, sizeof(time)) != 0
+				|| snapshot_get(&sr, &len, sizeof(len)) != 0) {
+				count = 0;
+				break;
+			}
+			data = sr.p;
+			if(snapshot_get(&sr, NULL, len) != 0) {
+				count = 0;
+				break;
+			}
+			if(channel) {
+				history_append(&channel->history, seq,
+						history_from_epoch(time), data, len);
+			}
+		}
+	}
+
+	munmap(base, st.st_size);
+	close(fd);
+}
+
+/**
+ * Take back the channels owned by the current worker from all the files,
+ * must run in the worker's thread after the journal has been replayed.
+ */
+void
+snapshot_load(struct worker *w) {
+
+	char path[1024];
+	int i;
+
+	if(!__path) {
+		return;
+	}
+	for(i = 0; ; ++i) {
+		snprintf(path, sizeof(path), "%s.%d", __path, i);
+		if(access(path, R_OK) != 0) {
+			break;
+		}
+		snapshot_load_file(w, path);
+	}
+}
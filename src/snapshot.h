@@ -0,0 +1,33 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Channel state saved on SIGUSR1 and on shutdown, and restored on startup,
+ * enabled with `snapshot <path>' in river.conf.
+ *
+ * Every worker writes the channels it owns to `<path>.<worker>', and on
+ * startup every worker maps all the files and takes back its own channels,
+ * whatever the number of threads was. Host byte order:
+ *
+ *	magic (32) | channel count (32)
+ *	then for each channel:
+ *	name length (32) | message count (32) | seq (64) | name
+ *	then for each message of its history:
+ *	seq (64) | time (64, ms since the epoch) | length (32) | data
+ */
+
+#define SNAPSHOT_MAGIC	0x31535652	/* "RVS1" */
+
+struct conf;
+struct worker;
+
+int
+snapshot_init(struct conf *cfg);
+
+int
+snapshot_write(struct worker *w, int sync);
+
+void
+snapshot_load(struct worker *w);
+
+#endif /* SNAPSHOT_H */
@@ -1,5 +1,8 @@
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <syslog.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,11 +11,20 @@
 #include "socket.h"
 #include "websocket.h"
 #include "channel.h"
+#include "heartbeat.h"
+#include "deadline.h"
+#include "slab.h"
 #include "mem.h"
 
 int server_max_cx;
 static int server_cur_cx = 0;
 
+/* reads land here unless a connection has leftover bytes. */
+static __thread char __read_buffer[CX_READ_SIZE];
+
+/* connections come and go with every long-poll. */
+static __thread struct slab __cx_slab = SLAB_INITIALIZER(sizeof(struct connection), MEM_CONNECTIONS);
+
 extern struct dispatcher_info di;
 
 /**
@@ -47,8 +59,15 @@ socket_setup(const char *ip, short port) {
 		return -1;
 	}
 
+	/* share the port between all the event loops. */
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+				sizeof(reuse)) < 0) {
+		syslog(LOG_ERR, "setsockopt error: %m\n");
+		return -1;
+	}
+
 	/* set socket as non-blocking. */
-	ret = fcntl(fd, F_SETFD, O_NONBLOCK);
+	ret = fcntl(fd, F_SETFL, O_NONBLOCK);
 	if (0 != ret) {
 		syslog(LOG_ERR, "fcntl error: %m\n");
 		return -1;
@@ -72,6 +91,78 @@ socket_setup(const char *ip, short port) {
 	return fd;
 }
 
+/**
+ * Sets up a non-blocking Unix domain socket, replacing any old one.
+ * A non-zero `mode' is applied before it listens, so that nobody can
+ * connect while it has the default permissions.
+ */
+int
+socket_setup_unix(const char *path, mode_t mode) {
+
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == fd) {
+		syslog(LOG_ERR, "Socket error: %m\n");
+		return -1;
+	}
+
+	if (0 != fcntl(fd, F_SETFL, O_NONBLOCK)) {
+		syslog(LOG_ERR, "fcntl error: %m\n");
+		close(fd);
+		return -1;
+	}
+
+	unlink(path);
+	if (0 != bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		syslog(LOG_ERR, "Bind error: %m\n");
+		close(fd);
+		return -1;
+	}
+
+	if (mode && 0 != chmod(path, mode)) {
+		syslog(LOG_ERR, "chmod error on %s: %m\n", path);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	if (0 != listen(fd, SOMAXCONN)) {
+		syslog(LOG_ERR, "Listen error: %m\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Remove a connection from outside of its own callbacks: it leaves its channel
+ * now, and is removed from the event loop once its output has been written.
+ */
+void
+cx_close(struct connection *cx) {
+
+	if(cx->cu) {
+		channel_del_connection(cx->channel, cx->cu);
+		cx->cu = NULL;
+	}
+	if(!cx->closing) {
+		cx->closing = 1;
+		event_del(&cx->ev);
+	}
+	output_flush(cx);
+}
+
 struct connection *
 cx_new(int fd, struct event_base *base) {
 	struct connection *cx;
@@ -80,51 +171,156 @@ cx_new(int fd, struct event_base *base) {
 	if(server_max_cx && server_cur_cx > server_max_cx) {
 		return NULL;
 	}
-	server_cur_cx++;
+	__sync_fetch_and_add(&server_cur_cx, 1);
 
-	cx = rcalloc(sizeof(struct connection), 1);
+	if(!(cx = slab_alloc(&__cx_slab))) {
+		__sync_fetch_and_sub(&server_cur_cx, 1);
+		return NULL;
+	}
 
 	cx->fd = fd;
 	cx->base = base;
-	cx->ev = rmalloc(sizeof(struct event));
-	memset(&cx->get, 0, sizeof(cx->get));
 
 	return cx;
 }
 
 void
 cx_remove(struct connection *cx) {
-	close(cx->fd);
-	server_cur_cx--;
 
+	/* stop receiving messages right away */
 	if(cx->cu) {
 		channel_del_connection(cx->channel, cx->cu);
+		cx->cu = NULL;
 	}
 
-	if(cx->ev) {
-		event_del(cx->ev);
-		rfree(cx->ev);
+	/* finish writing first, the output will remove us again. */
+	if(output_pending(cx) && !cx->out.broken) {
+		if(!cx->closing) {
+			cx->closing = 1;
+			event_del(&cx->ev);
+		}
+		return;
 	}
 
-	/* cleanup */
-	rfree(cx->headers.host);
-	rfree(cx->headers.origin);
-	rfree(cx->path);
+	/* events first, the write event can still be armed */
+	heartbeat_stop(cx);
+	deadline_stop(cx);
+	event_del(&cx->ev);
+	output_free(cx);
 
-	rfree(cx->headers.ws1);
-	rfree(cx->headers.ws2);
-	rfree(cx->post);
+	close(cx->fd);
+	__sync_fetch_and_sub(&server_cur_cx, 1);
+
+	/* cleanup */
+	cx_reset(cx);
+	arena_free(&cx->arena);
+	rfree(cx->in);
 
 	if(cx->wsc) {
-		evbuffer_free(cx->wsc->buffer);
+		if(cx->wsc->message) {
+			evbuffer_free(cx->wsc->message);
+		}
 		rfree(cx->wsc);
 	}
 
-	rfree(cx->get.name);
-	rfree(cx->get.data);
-	rfree(cx->get.jsonp);
-	rfree(cx->get.domain);
+	slab_free(&__cx_slab, cx);
+}
+
+/**
+ * Forget about the last request, before reading a new one.
+ */
+void
+cx_reset(struct connection *cx) {
+
+	/* all the strings of the request at once */
+	arena_reset(&cx->arena);
+
+	memset(&cx->get, 0, sizeof(cx->get));
+	memset(&cx->headers, 0, sizeof(cx->headers));
+	cx->path = NULL;
+	cx->path_len = 0;
+	cx->url = NULL;
+	cx->url_len = 0;
+	cx->body = NULL;
+	cx->body_len = 0;
+	cx->header_next_len = 0;
+	cx->header_value = 0;
+	cx->post = NULL;
+	cx->post_len = 0;
+	cx->parsing = 0;
+	cx->request_done = 0;
+	cx->state = CX_STARTING;
+}
+
+/**
+ * Read from a connection. The data is placed after what cx_keep saved
+ * last time, *data points to the first byte of it all.
+ * Returns the number of bytes available, 0 on EOF or -1 on error,
+ * with errno set to EMSGSIZE if more than CX_INPUT_MAX bytes are waiting.
+ */
+int
+cx_read(struct connection *cx, char **data) {
+
+	int nb_read;
+
+	if(!cx->in_len) { /* common case, nothing to prepend. */
+		nb_read = read(cx->fd, __read_buffer, sizeof(__read_buffer));
+		*data = __read_buffer;
+		return nb_read;
+	}
+
+	if(cx->in_size - cx->in_len < CX_READ_SIZE / 4) {
+		if(cx_keep(cx, cx->in, cx->in_len) < 0) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+	}
+
+	nb_read = read(cx->fd, cx->in + cx->in_len, cx->in_size - cx->in_len);
+	if(nb_read <= 0) {
+		return nb_read;
+	}
+	cx->in_len += nb_read;
+	*data = cx->in;
+
+	return (int)cx->in_len;
+}
+
+/**
+ * Save len bytes that couldn't be consumed yet, they will be returned
+ * again by the next cx_read. data can point inside of cx->in.
+ */
+int
+cx_keep(struct connection *cx, const char *data, size_t len) {
+
+	size_t size;
+	char *in;
+
+	if(!len) {
+		rfree(cx->in);
+		cx->in = NULL;
+		cx->in_len = cx->in_size = 0;
+		return 0;
+	}
+
+	/* leave some room for the next read */
+	for(size = cx->in_size ? cx->in_size : CX_READ_SIZE / 4;
+			size < len + CX_READ_SIZE / 4; size *= 2);
+	if(size > CX_INPUT_MAX) {
+		return -1;
+	}
+
+	if(size == cx->in_size) {
+		memmove(cx->in, data, len);
+	} else {
+		in = rmalloc_in(MEM_BUFFERS, size);
+		memcpy(in, data, len);
+		rfree(cx->in);
+		cx->in = in;
+		cx->in_size = size;
+	}
+	cx->in_len = len;
 
-	rfree(cx);
+	return 0;
 }
 
@@ -2,19 +2,33 @@
 #define SOCKET_H
 
 #include <stdlib.h>
+#include <sys/types.h>
+#include <event.h>
+
+#include "output.h"
+#include "http.h"
+#include "arena.h"
+#include "wheel.h"
 
-struct event;
-struct event_base;
 struct channel_user;
 struct ws_client;
+struct worker;
+
+#define CX_READ_SIZE	(64*1024)	/* bytes per read */
+#define CX_INPUT_MAX	(1024*1024)	/* unconsumed bytes kept per connection */
+#define CX_HEADER_NAME	32		/* enough to recognize the headers we read */
 
 int
 socket_setup(const char *ip, short port);
 
+int
+socket_setup_unix(const char *path, mode_t mode);
+
 typedef enum {
 	CX_STARTING = 0,
 	CX_BROKEN,
 	CX_PUBLISHING,
+	CX_PUBLISHING_BINARY,
 	CX_CONNECTED_COMET,
 	CX_CONNECTED_WEBSOCKET,
 	CX_SENDING_FILE} cx_state;
@@ -23,10 +37,20 @@ struct connection {
 
 	int fd;
 	struct event_base *base;
-	struct event *ev;
+	struct event ev;
 
 	cx_state state;
 
+	/* parser state for the current request, kept across reads */
+	http_parser parser;
+	int parsing;
+	int request_done;
+
+	/* received bytes that couldn't be consumed yet */
+	char *in;
+	size_t in_len;
+	size_t in_size;
+
 	/* http stuff */
 	struct {
 		char *name; int name_len;
@@ -35,29 +59,56 @@ struct connection {
 		char *domain; int domain_len;
 
 		unsigned long long seq; int has_seq;
+		unsigned long long since; int has_since; /* milliseconds */
 		long keep;
 	} get;
 
 	/* URL */
 	char *path;
 	size_t path_len;
+	char *url;
+	size_t url_len;
+
+	/* strings above and below, until the request is done */
+	struct arena arena;
 
-	char *header_next; /* used in header parsing */
+	char header_next[CX_HEADER_NAME]; /* start of the current header's name */
+	size_t header_next_len;
+	int header_value; /* header_next already has its value */
 	struct {
 		char *host; size_t host_len;
 		char *origin; size_t origin_len;
 
-		char *ws1; int ws1_len;
-		char *ws2; int ws2_len;
+		char *ws1; size_t ws1_len; /* hixie-76 */
+		char *ws2; size_t ws2_len;
+		char *ws_key; size_t ws_key_len; /* RFC 6455 */
+		char *ws_ext; size_t ws_ext_len;
 
 	} headers;
 
 	/* body */
+	char *body; size_t body_len;
+
+	/* data following an upgrade request */
 	char *post; int post_len;
 
+	/* worker taking the connection after an HTTP_HANDOFF */
+	struct worker *handoff;
+
 	struct channel *channel;
 	struct channel_user *cu;
 	struct ws_client *wsc;
+
+	/* data waiting to be written */
+	struct output out;
+	int closing; /* remove once the output is written */
+
+	/* request_timeout, then client_timeout; see deadline.c */
+	struct wheel_timer deadline;
+
+	/* probes subscribers, see heartbeat.c */
+	struct wheel_timer heartbeat;
+	size_t heartbeat_written; /* out.written at the last beat */
 };
 
 struct connection *
@@ -66,4 +117,16 @@ cx_new(int fd, struct event_base *base);
 void
 cx_remove(struct connection *cx);
 
+void
+cx_close(struct connection *cx);
+
+void
+cx_reset(struct connection *cx);
+
+int
+cx_read(struct connection *cx, char **data);
+
+int
+cx_keep(struct connection *cx, const char *data, size_t len);
+
 #endif
@@ -0,0 +1,544 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <event.h>
+
+#include "upgrade.h"
+#include "worker.h"
+#include "server.h"
+#include "socket.h"
+#include "channel.h"
+#include "websocket.h"
+#include "publish.h"
+#include "snapshot.h"
+#include "heartbeat.h"
+#include "deadline.h"
+#include "output.h"
+#include "conf.h"
+#include "mem.h"
+
+/* transports of the subscribers */
+#define UPGRADE_COMET		0
+#define UPGRADE_WEBSOCKET	1	/* hixie-76 */
+#define UPGRADE_WEBSOCKET13	2	/* RFC 6455 */
+#define UPGRADE_WEBSOCKET13_DEFLATE	3	/* with permessage-deflate */
+
+/* seconds to wait for the old server */
+#define UPGRADE_TIMEOUT	30
+
+/* a subscriber received from the old server */
+struct upgrade_sub {
+	int fd;
+	int transport;
+	int keep;
+	unsigned long long seq;
+	char *name;
+	size_t name_len;
+	char *jsonp;
+
+	struct upgrade_sub *next;
+};
+
+/* new server: sockets received from the old one, -1 once taken. */
+static int *__inherited[UPGRADE_KINDS];
+static int __inherited_count[UPGRADE_KINDS];
+static int __old = -1;
+static struct upgrade_sub **__adopt = NULL; /* per worker */
+
+/* old server: the new one, written to by all the workers. */
+static int __listen_fd = -1;
+static struct event __ev_listen;
+static int __peer = -1;
+static int __pending = 0;
+static pthread_mutex_t __peer_lock = PTHREAD_MUTEX_INITIALIZER;
+static int __subscribers = 0;
+
+/**
+ * Send a buffer with file descriptors attached to its first byte.
+ */
+static int
+upgrade_send(int fd, const void *data, size_t len, const int *fds, int nfds) {
+
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+	} control;
+	ssize_t ret, n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(nfds) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+
+	if((ret = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+		return -1;
+	}
+	for(; (size_t)ret < len; ret += n) { /* the rest goes without them */
+		if((n = send(fd, (const char *)data + ret, len - ret, MSG_NOSIGNAL)) <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Read exactly len bytes, and the file descriptors sent with them.
+ * Returns the number of descriptors, or -1.
+ */
+static int
+upgrade_recv(int fd, void *data, size_t len, int *fds, int max) {
+
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+	} control;
+	ssize_t ret, n;
+	int nfds = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if((ret = recvmsg(fd, &msg, MSG_WAITALL)) <= 0) {
+		return -1;
+	}
+	for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if(nfds + n > max) { /* not expected, don't keep them */
+				int *extra = (int *)CMSG_DATA(cm), i;
+				for(i = 0; i < n; ++i) {
+					close(extra[i]);
+				}
+				continue;
+			}
+			memcpy(fds + nfds, CMSG_DATA(cm), n * sizeof(int));
+			nfds += n;
+		}
+	}
+	for(; (size_t)ret < len; ret += n) {
+		if((n = recv(fd, (char *)data + ret, len - ret, MSG_WAITALL)) <= 0) {
+			return -1;
+		}
+	}
+	return nfds;
+}
+
+/**
+ * Take over from a server running with the same configuration, if any:
+ * receive its listening sockets. Must run before worker_init.
+ */
+int
+upgrade_connect(struct conf *cfg) {
+
+	struct sockaddr_un addr;
+	struct timeval tv = {UPGRADE_TIMEOUT, 0};
+	int fds[UPGRADE_MAX_FDS], nfds, i, k, pos;
+	uint32_t counts[UPGRADE_KINDS];
+	char header[1 + sizeof(counts)];
+
+	if(!cfg->upgrade_socket) {
+		return 0;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(cfg->upgrade_socket) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "Socket path too long: %s\n", cfg->upgrade_socket);
+		return -1;
+	}
+	strcpy(addr.sun_path, cfg->upgrade_socket);
+
+	if((__old = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+	if(connect(__old, (struct sockaddr *)&addr, sizeof(addr)) != 0) { /* nobody there */
+		close(__old);
+		__old = -1;
+		return 0;
+	}
+	setsockopt(__old, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	nfds = upgrade_recv(__old, header, sizeof(header), fds, UPGRADE_MAX_FDS);
+	memcpy(counts, header + 1, sizeof(counts));
+	if(nfds < 0 || header[0] != 'L'
+		|| (int)(counts[0] + counts[1] + counts[2]) != nfds) {
+		syslog(LOG_ERR, "upgrade: invalid reply from the running server\n");
+		return -1;
+	}
+	for(k = 0, pos = 0; k < UPGRADE_KINDS; ++k) {
+		__inherited_count[k] = (int)counts[k];
+		__inherited[k] = rmalloc(counts[k] * sizeof(int) + 1);
+		for(i = 0; i < (int)counts[k]; ++i) {
+			__inherited[k][i] = fds[pos++];
+		}
+	}
+	return 0;
+}
+
+/**
+ * The i-th listening socket of a kind received from the old server, -1 if none.
+ */
+int
+upgrade_take(upgrade_kind kind, int i) {
+
+	int fd;
+
+	if(i >= __inherited_count[kind] || __inherited[kind][i] == -1) {
+		return -1;
+	}
+	fd = __inherited[kind][i];
+	__inherited[kind][i] = -1;
+	return fd;
+}
+
+/**
+ * Receive the subscribers of the old server, and wait for it to exit.
+ * Must run after worker_init.
+ */
+int
+upgrade_receive() {
+
+	struct upgrade_sub *s;
+	char type, *buffer, *p;
+	uint32_t len;
+	uint16_t name_len, jsonp_len;
+	int fd, nfds, owner;
+
+	if(__old == -1) {
+		return 0;
+	}
+	__adopt = rcalloc(worker_count(), sizeof(struct upgrade_sub *));
+
+	while((nfds = upgrade_recv(__old, &type, 1, &fd, 1)) >= 0 && type == 'S') {
+		if(nfds != 1 || upgrade_recv(__old, &len, sizeof(len), NULL, 0) != 0
+			|| len < 14) {
+			break;
+		}
+		buffer = rmalloc(len);
+		if(upgrade_recv(__old, buffer, len, NULL, 0) != 0) {
+			rfree(buffer);
+			break;
+		}
+		memcpy(&name_len, buffer + 10, sizeof(name_len));
+		memcpy(&jsonp_len, buffer + 12, sizeof(jsonp_len));
+		if(14 + (uint32_t)name_len + jsonp_len != len || !name_len) {
+			rfree(buffer);
+			close(fd);
+			continue;
+		}
+
+		s = rcalloc(1, sizeof(struct upgrade_sub));
+		s->fd = fd;
+		s->transport = buffer[0];
+		s->keep = buffer[1];
+		memcpy(&s->seq, buffer + 2, sizeof(s->seq));
+		p = buffer + 14;
+		s->name = rcalloc(name_len + 1, 1);
+		memcpy(s->name, p, name_len);
+		s->name_len = name_len;
+		if(jsonp_len) {
+			s->jsonp = rcalloc(jsonp_len + 1, 1);
+			memcpy(s->jsonp, p + name_len, jsonp_len);
+		}
+		rfree(buffer);
+
+		/* the worker owning the channel takes it when it starts. */
+		owner = worker_owner(s->name, s->name_len)->id;
+		s->next = __adopt[owner];
+		__adopt[owner] = s;
+	}
+	if(nfds < 0 || type != 'E') {
+		syslog(LOG_ERR, "upgrade: the running server didn't finish\n");
+	}
+
+	/* its journal and snapshot are complete once it has exited. */
+	while(recv(__old, &type, 1, 0) > 0);
+	close(__old);
+	__old = -1;
+
+	return 0;
+}
+
+static void
+upgrade_subscribe(struct worker *w, struct upgrade_sub *s) {
+
+	struct connection *cx;
+	struct channel *channel;
+
+	if(!(cx = cx_new(s->fd, w->base))) {
+		close(s->fd);
+		return;
+	}
+	if(!(channel = channel_find(s->name, s->name_len))) {
+		channel = channel_new(s->name);
+	}
+	/* they have received everything up to there */
+	if(channel->seq < s->seq) {
+		channel->seq = s->seq;
+	}
+	cx->channel = channel;
+
+	if(s->transport == UPGRADE_WEBSOCKET) {
+		cx->state = CX_CONNECTED_WEBSOCKET;
+		ws_client_new(cx, WS_HIXIE76);
+		cx->cu = channel_new_connection(cx, s->keep, s->jsonp, ws_encode);
+	} else if(s->transport == UPGRADE_WEBSOCKET13) {
+		cx->state = CX_CONNECTED_WEBSOCKET;
+		ws_client_new(cx, WS_RFC6455);
+		cx->cu = channel_new_connection(cx, s->keep, s->jsonp, ws13_encode);
+	} else if(s->transport == UPGRADE_WEBSOCKET13_DEFLATE) {
+		cx->state = CX_CONNECTED_WEBSOCKET;
+		ws_client_new(cx, WS_RFC6455);
+		cx->wsc->deflate = 1;
+		cx->cu = channel_new_connection(cx, s->keep, s->jsonp, ws13_encode_deflate);
+	} else {
+		cx->state = CX_CONNECTED_COMET;
+		cx->cu = channel_new_connection(cx, s->keep, s->jsonp, http_chunk_encode);
+	}
+	channel_add_connection(channel, cx->cu);
+	heartbeat_start(cx);
+	deadline_client(cx);
+
+	event_set(&cx->ev, cx->fd, EV_READ, on_available_data, cx);
+	event_base_set(w->base, &cx->ev);
+	event_add(&cx->ev, NULL);
+}
+
+/**
+ * Accept on the sockets nobody took: the old server had more threads.
+ */
+static void
+upgrade_accept_leftovers(struct worker *w) {
+
+	struct event *ev;
+	int k, i, fd;
+
+	for(k = 0; k < UPGRADE_KINDS; ++k) {
+		for(i = 0; i < __inherited_count[k]; ++i) {
+			if((fd = __inherited[k][i]) == -1 || i % worker_count() != w->id) {
+				continue;
+			}
+			ev = rcalloc(1, sizeof(struct event));
+			event_set(ev, fd, EV_READ | EV_PERSIST,
+					k == UPGRADE_HTTP ? on_possible_accept : on_publish_accept,
+					w->base);
+			event_base_set(w->base, ev);
+			event_add(ev, NULL);
+		}
+	}
+}
+
+/**
+ * Take the subscribers of the channels owned by the current worker,
+ * once they have been restored.
+ */
+void
+upgrade_adopt(struct worker *w) {
+
+	struct upgrade_sub *s, *next;
+
+	upgrade_accept_leftovers(w);
+	if(!__adopt) {
+		return;
+	}
+	for(s = __adopt[w->id]; s; s = next) {
+		next = s->next;
+		upgrade_subscribe(w, s);
+		rfree(s->name);
+		rfree(s->jsonp);
+		rfree(s);
+	}
+	__adopt[w->id] = NULL;
+}
+
+/**
+ * A new server is starting: give it our listening sockets, then let
+ * every worker save and send its channels.
+ */
+static void
+on_upgrade_accept(int fd, short event, void *ptr) {
+	(void)event;
+	(void)ptr;
+
+	int fds[UPGRADE_MAX_FDS], nfds = 0, i, peer;
+	uint32_t counts[UPGRADE_KINDS] = {0, 0, 0};
+	char header[1 + sizeof(counts)];
+
+	if((peer = accept(fd, NULL, NULL)) == -1) {
+		return;
+	}
+	fcntl(peer, F_SETFL, 0); /* blocking */
+
+	for(i = 0; i < worker_count() && nfds < UPGRADE_MAX_FDS; ++i, ++counts[0]) {
+		fds[nfds++] = worker_get(i)->fd;
+	}
+	for(i = 0; publish_listener(i) != -1 && nfds < UPGRADE_MAX_FDS; ++i, ++counts[1]) {
+		fds[nfds++] = publish_listener(i);
+	}
+	if(publish_listener_unix() != -1 && nfds < UPGRADE_MAX_FDS) {
+		fds[nfds++] = publish_listener_unix();
+		counts[2] = 1;
+	}
+	header[0] = 'L';
+	memcpy(header + 1, counts, sizeof(counts));
+	if(upgrade_send(peer, header, sizeof(header), fds, nfds) != 0) {
+		syslog(LOG_ERR, "upgrade: can't send the listening sockets: %m\n");
+		close(peer);
+		return;
+	}
+
+	/* one upgrade only, the new server listens after us. */
+	event_del(&__ev_listen);
+	close(__listen_fd);
+
+	__peer = peer;
+	__pending = worker_count();
+	worker_broadcast(CMD_UPGRADE);
+}
+
+/**
+ * Wait for the next server on the upgrade socket.
+ */
+int
+upgrade_listen(struct conf *cfg) {
+
+	if(!cfg->upgrade_socket) {
+		return 0;
+	}
+	__subscribers = cfg->upgrade_subscribers;
+
+	/* whoever connects gets our sockets */
+	if((__listen_fd = socket_setup_unix(cfg->upgrade_socket, 0600)) == -1) {
+		return -1;
+	}
+
+	event_set(&__ev_listen, __listen_fd, EV_READ | EV_PERSIST, on_upgrade_accept, NULL);
+	event_base_set(worker_get(0)->base, &__ev_listen);
+	event_add(&__ev_listen, NULL);
+
+	return 0;
+}
+
+/**
+ * Subscribers with nothing in flight, which can change process.
+ */
+static int
+upgrade_idle(struct connection *cx) {
+
+	if(cx->state != CX_CONNECTED_COMET && cx->state != CX_CONNECTED_WEBSOCKET) {
+		return 0;
+	}
+	if(cx->closing || cx->in_len || output_pending(cx)) {
+		return 0;
+	}
+	if(cx->wsc && cx->wsc->fragmented) {
+		return 0;
+	}
+	return cx->cu->efun == http_chunk_encode || cx->cu->efun == ws_encode
+		|| cx->cu->efun == ws13_encode || cx->cu->efun == ws13_encode_deflate;
+}
+
+static void
+upgrade_channel(struct channel *channel, void *ptr) {
+
+	struct channel_user *cu, *next;
+	struct connection *cx;
+	char *buffer;
+	uint32_t len;
+	uint16_t name_len, jsonp_len;
+	uint64_t seq = channel->seq;
+	int ret;
+
+	(void)ptr;
+	if(channel->name_len > 0xffff) {
+		return;
+	}
+	for(cu = channel->user_list; cu; cu = next) {
+		next = cu->next;
+		cx = cu->cx;
+		if(!upgrade_idle(cx) || cu->jsonp_len > 0xffff) {
+			continue;
+		}
+
+		name_len = (uint16_t)channel->name_len;
+		jsonp_len = (uint16_t)cu->jsonp_len;
+		len = 14 + name_len + jsonp_len;
+		buffer = rmalloc(5 + len);
+		buffer[0] = 'S';
+		memcpy(buffer + 1, &len, sizeof(len));
+		if(cu->efun == ws13_encode) {
+			buffer[5] = UPGRADE_WEBSOCKET13;
+		} else if(cu->efun == ws13_encode_deflate) {
+			buffer[5] = UPGRADE_WEBSOCKET13_DEFLATE;
+		} else {
+			buffer[5] = cu->efun == ws_encode ? UPGRADE_WEBSOCKET : UPGRADE_COMET;
+		}
+		buffer[6] = (char)cu->keep_connected;
+		memcpy(buffer + 7, &seq, sizeof(seq));
+		memcpy(buffer + 15, &name_len, sizeof(name_len));
+		memcpy(buffer + 17, &jsonp_len, sizeof(jsonp_len));
+		memcpy(buffer + 19, channel->name, name_len);
+		memcpy(buffer + 19 + name_len, cu->jsonp, jsonp_len);
+
+		pthread_mutex_lock(&__peer_lock);
+		ret = upgrade_send(__peer, buffer, 5 + len, &cx->fd, 1);
+		pthread_mutex_unlock(&__peer_lock);
+		rfree(buffer);
+
+		if(ret == 0) { /* the new server has its own copy of the socket */
+			cx_remove(cx);
+		}
+	}
+}
+
+/**
+ * Hand the current worker over to the new server, and stop.
+ */
+void
+upgrade_handoff(struct worker *w) {
+
+	/* the new server accepts from now on */
+	event_del(&w->ev_accept);
+	publish_stop(w);
+
+	/* read right away by the new server, no need to wait for the disk. */
+	snapshot_write(w, 0);
+	if(__subscribers) {
+		channel_foreach(upgrade_channel, w);
+	}
+
+	pthread_mutex_lock(&__peer_lock);
+	if(--__pending == 0) { /* the socket closes when we exit */
+		upgrade_send(__peer, "E", 1, NULL, 0);
+	}
+	pthread_mutex_unlock(&__peer_lock);
+
+	event_base_loopexit(w->base, NULL);
+}
@@ -0,0 +1,54 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+ * Graceful upgrade, enabled with `upgrade_socket <path>' in river.conf.
+ *
+ * A running server waits for its successor on this Unix socket. A new
+ * server started with the same configuration connects to it and receives,
+ * with SCM_RIGHTS:
+ *
+ *	'L' | HTTP count (32) | publish count (32) | publish socket (32)
+ *		with the listening sockets attached, in that order.
+ *	'S' | length (32) | transport (8) | keep (8) | seq (64)
+ *		| name length (16) | callback length (16) | name | callback
+ *		with an idle subscriber attached (if `upgrade_subscribers' is set).
+ *	'E'	when all the workers are done.
+ *
+ * The old server saves its snapshot before sending its subscribers, and
+ * leaves right after 'E'. Once it has exited, the new server restores the
+ * channels and takes the subscribers back, at the last seq they received.
+ * Pending connections wait in the listening sockets, which never close.
+ */
+
+#define UPGRADE_MAX_FDS	256
+
+typedef enum {
+	UPGRADE_HTTP = 0,
+	UPGRADE_PUBLISH,
+	UPGRADE_PUBLISH_UNIX,
+	UPGRADE_KINDS
+} upgrade_kind;
+
+struct conf;
+struct worker;
+
+int
+upgrade_connect(struct conf *cfg);
+
+int
+upgrade_take(upgrade_kind kind, int i);
+
+int
+upgrade_receive();
+
+int
+upgrade_listen(struct conf *cfg);
+
+void
+upgrade_adopt(struct worker *w);
+
+void
+upgrade_handoff(struct worker *w);
+
+#endif /* UPGRADE_H */
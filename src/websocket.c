@@ -1,16 +1,53 @@
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <event.h>
 #include <string.h>
+#include <stdint.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define WS_SIMD 1
+#endif
 
 #include "websocket.h"
 #include "channel.h"
 #include "server.h"
 #include "socket.h"
+#include "output.h"
 #include "md5.h"
+#include "sha1.h"
 #include "mem.h"
 
+/* single-frame messages of a read, published together. They point into
+ * the read buffer, so they are sent before it is reused. */
+struct ws_batch {
+	struct iovec msgs[CHANNEL_BATCH_MAX];
+	unsigned int count;
+};
+
+static void
+ws_batch_flush(struct connection *cx, struct ws_batch *batch) {
+
+	if(batch->count) {
+		channel_write_batch(cx->channel, batch->msgs, batch->count);
+		batch->count = 0;
+	}
+}
+
+static void
+ws_batch_add(struct connection *cx, struct ws_batch *batch, const unsigned char *data, size_t len) {
+
+	if(batch->count == CHANNEL_BATCH_MAX) {
+		ws_batch_flush(cx, batch);
+	}
+	batch->msgs[batch->count].iov_base = (void*)data;
+	batch->msgs[batch->count].iov_len = len;
+	batch->count++;
+}
+
 /**
  * Called when a client connects using websocket, does the handshake.
  */
@@ -51,16 +88,26 @@ ws_start(struct connection *cx) {
 	sprintf(buffer, template, cx->headers.origin, cx->headers.host,
 			cx->get.name, cx->headers.host);
 	memcpy(buffer + sz - sizeof(handshake), handshake, sizeof(handshake));
-	ret = write(cx->fd, buffer, sz);
+	ret = output_write(cx, buffer, sz);
 	rfree(buffer);
 
-	struct ws_client *wsc = rcalloc(1, sizeof(struct ws_client));
-	wsc->buffer = evbuffer_new();
-	cx->wsc = wsc;
+	ws_client_new(cx, WS_HIXIE76);
+	cx_keep(cx, NULL, 0); /* the handshake was all there was */
 
 	return ret;
 }
 
+/**
+ * Websocket state of a connection which is past the handshake.
+ */
+void
+ws_client_new(struct connection *cx, ws_version version) {
+
+	struct ws_client *wsc = rcalloc_in(MEM_CONNECTIONS, 1, sizeof(struct ws_client));
+	wsc->version = version;
+	cx->wsc = wsc;
+}
+
 static uint32_t
 ws_read_key(char *p) {
 	uint32_t ret = 0, spaces = 0;
@@ -100,69 +147,625 @@ ws_handshake(struct connection *cx, unsigned char *out) {
 }
 
 /**
- * Sends a message to a websocket client, by a write on a channel
+ * Wraps data in a websocket frame.
  */
-int
-ws_write(struct connection *cx, const char *buf, size_t len) {
+char *
+ws_encode(const char *buf, size_t len, size_t *out_len) {
 
-	int ret;
-
-	char *tmp = rmalloc(2+len);
+	char *tmp = rmalloc_in(MEM_BUFFERS, 2+len);
 
 	tmp[0] = 0;
 	tmp[len+1] = 0xff;
 	memcpy(tmp+1, buf, len);
 
-	ret = write(cx->fd, tmp, len+2);
+	*out_len = len + 2;
+	return tmp;
+}
 
-	if(ret != (int)len+2) {
-		rfree(tmp);
-		return -1;
+static int
+ws13_process(struct connection *cx, struct ws_batch *batch, unsigned char *data, size_t avail);
+
+/**
+ * hixie-76 frames: 0x00, the message, 0xff.
+ * Returns the number of bytes used, or -1 on error.
+ */
+static int
+ws_process(struct connection *cx, struct ws_batch *batch, unsigned char *data, size_t avail) {
+
+	unsigned char *p = data, *end = data + avail, *last;
+
+	while(p < end) {
+		if(*p != 0) { /* missing frame start */
+			return -1;
+		}
+		last = memchr(p, 0xff, end - p);
+		if(!last) { /* no end of frame in sight, keep what we have for now. */
+			break;
+		}
+		ws_batch_add(cx, batch, p + 1, last - p - 1);
+		p = last + 1;
 	}
-	rfree(tmp);
-	return len;
+	return (int)(p - data);
 }
 
 /**
- * Called when we received a message from a websocket client.
+ * Called when we received data from a websocket client. Frames are parsed
+ * where they were read, and a partial one is kept for the next read.
  */
 int
 ws_client_msg(struct connection *cx) {
-	char packet[1024], *pos;
-	int ret, success = 1;
 
-	/* read message */
-	ret = read(cx->fd, packet, sizeof(packet));
-	if(ret <= 0) {
-		/* ws_close(cx); */
+	struct ws_batch batch;
+	char *data;
+	int nb_read, used;
+
+	nb_read = cx_read(cx, &data);
+	if(nb_read < 0 && (errno == EAGAIN || errno == EINTR)) { /* nothing yet */
+		return 0;
+	}
+	if(nb_read <= 0) {
 		return -1;
 	}
-	pos = packet;
-	unsigned char *data, *last;
-	int sz, msg_sz;
-	evbuffer_add(cx->wsc->buffer, packet, ret);
+	cx->wsc->ping_pending = 0; /* it is alive */
 
-	while(1) {
-		data = EVBUFFER_DATA(cx->wsc->buffer);
-		sz = EVBUFFER_LENGTH(cx->wsc->buffer);
+	batch.count = 0;
+	if(cx->wsc->version == WS_RFC6455) {
+		used = ws13_process(cx, &batch, (unsigned char *)data, (size_t)nb_read);
+	} else {
+		used = ws_process(cx, &batch, (unsigned char *)data, (size_t)nb_read);
+	}
+	ws_batch_flush(cx, &batch);
 
-		if(sz == 0) { /* no data */
-			break;
+	if(used < 0 || cx_keep(cx, data + used, nb_read - used) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * RFC 6455
+ */
+
+#define WS13_GUID	"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS13_FIN	0x80
+#define WS13_RSV1	0x40	/* compressed message */
+#define WS13_MASK	0x80
+
+#define WS13_CONTINUATION	0x0
+#define WS13_TEXT		0x1
+#define WS13_BINARY		0x2
+#define WS13_CLOSE		0x8
+#define WS13_PING		0x9
+#define WS13_PONG		0xa
+
+#define WS13_CONTROL_MAX	125	/* payload of control frames */
+#define WS13_FRAME_MAX		(CX_INPUT_MAX - CX_READ_SIZE) /* kept until complete */
+#define WS13_HEADER_MAX		10	/* server frames, without a mask */
+
+/* permessage-deflate (RFC 7692): every message is compressed on its own,
+ * so that the same frame can be sent to all the subscribers. */
+#define WS_DEFLATE_EXTENSION	"Sec-WebSocket-Extensions: permessage-deflate; " \
+	"server_no_context_takeover; client_no_context_takeover\r\n"
+#define WS_DEFLATE_MIN		64	/* smaller messages are sent as they are */
+
+static __thread z_stream __deflate;
+static __thread int __deflate_ready = 0;
+static __thread z_stream __inflate;
+static __thread int __inflate_ready = 0;
+static __thread struct evbuffer *__inflated = NULL;
+
+static void
+ws_base64(const unsigned char *in, size_t len, char *out) {
+
+	static const char table[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+	size_t i;
+
+	for(i = 0; i + 2 < len; i += 3) {
+		v = (uint32_t)in[i] << 16 | (uint32_t)in[i+1] << 8 | in[i+2];
+		*out++ = table[v >> 18];
+		*out++ = table[(v >> 12) & 63];
+		*out++ = table[(v >> 6) & 63];
+		*out++ = table[v & 63];
+	}
+	if(i < len) { /* one or two bytes left */
+		v = (uint32_t)in[i] << 16 | (i + 1 < len ? (uint32_t)in[i+1] << 8 : 0);
+		*out++ = table[v >> 18];
+		*out++ = table[(v >> 12) & 63];
+		*out++ = i + 1 < len ? table[(v >> 6) & 63] : '=';
+		*out++ = '=';
+	}
+	*out = 0;
+}
+
+static int
+ws_token(const char *p, size_t len, const char *token) {
+
+	/* trim */
+	for(; len && (*p == ' ' || *p == '\t'); p++, len--);
+	for(; len && (p[len-1] == ' ' || p[len-1] == '\t'); len--);
+
+	return len == strlen(token) && strncasecmp(p, token, len) == 0;
+}
+
+/**
+ * Look for a permessage-deflate offer that we can take, in a
+ * comma-separated list of extensions with their parameters.
+ */
+static int
+ws13_deflate_offered(const char *ext, size_t len) {
+
+	const char *end = ext + len, *offer, *offer_end, *param, *param_end, *eq;
+	int ok;
+
+	for(offer = ext; offer < end; offer = offer_end + 1) {
+		if(!(offer_end = memchr(offer, ',', end - offer))) {
+			offer_end = end;
 		}
-		if(*data != 0) { /* missing frame start */
-			success = 0;
-			break;
+		if(!(param_end = memchr(offer, ';', offer_end - offer))) {
+			param_end = offer_end;
 		}
-		last = memchr(data, 0xff, sz);
-		if(!last) { /* no end of frame in sight, keep what we have for now. */
-			break;
+		if(!ws_token(offer, param_end - offer, "permessage-deflate")) {
+			continue;
 		}
-		msg_sz = last - data - 1;
-		channel_write(cx->channel, (const char*)data + 1, msg_sz);
 
-		/* drain including frame delimiters (+2 bytes) */
-		evbuffer_drain(cx->wsc->buffer, msg_sz + 2);
+		/* we always compress without context takeover and with the
+		 * largest window, the client can do as it likes. */
+		for(ok = 1, param = param_end + 1; ok && param < offer_end; param = param_end + 1) {
+			if(!(param_end = memchr(param, ';', offer_end - param))) {
+				param_end = offer_end;
+			}
+			if(!(eq = memchr(param, '=', param_end - param))) {
+				eq = param_end;
+			}
+			if(ws_token(param, eq - param, "server_max_window_bits")) {
+				ok = eq < param_end && ws_token(eq + 1, param_end - eq - 1, "15");
+			} else {
+				ok = ws_token(param, eq - param, "server_no_context_takeover")
+					|| ws_token(param, eq - param, "client_no_context_takeover")
+					|| ws_token(param, eq - param, "client_max_window_bits");
+			}
+		}
+		if(ok) {
+			return 1;
+		}
 	}
 	return 0;
 }
 
+/**
+ * Called when a client connects using RFC 6455, does the handshake.
+ */
+int
+ws13_start(struct connection *cx) {
+
+	char template[] = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"%s"
+		"\r\n";
+	char buffer[sizeof(template) + 32 + sizeof(WS_DEFLATE_EXTENSION)], accept[32];
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	sha1_state_t ctx;
+	struct ws_batch batch;
+	int ret, deflate, used;
+
+	/* 16 random bytes in base64 */
+	if(cx->headers.ws_key_len != 24) {
+		return -1;
+	}
+
+	sha1_init(&ctx);
+	sha1_append(&ctx, (const unsigned char *)cx->headers.ws_key, cx->headers.ws_key_len);
+	sha1_append(&ctx, (const unsigned char *)WS13_GUID, sizeof(WS13_GUID) - 1);
+	sha1_finish(&ctx, digest);
+	ws_base64(digest, sizeof(digest), accept);
+
+	deflate = cx->cu && cx->headers.ws_ext
+		&& ws13_deflate_offered(cx->headers.ws_ext, cx->headers.ws_ext_len);
+
+	ret = snprintf(buffer, sizeof(buffer), template, accept,
+			deflate ? WS_DEFLATE_EXTENSION : "");
+	ret = output_write(cx, buffer, ret);
+
+	ws_client_new(cx, WS_RFC6455);
+	if(deflate) { /* messages are compressed once, for all these users */
+		cx->wsc->deflate = 1;
+		cx->cu->efun = ws13_encode_deflate;
+	}
+
+	/* frames sent without waiting for our reply */
+	batch.count = 0;
+	used = ws13_process(cx, &batch, (unsigned char *)cx->post, cx->post_len);
+	ws_batch_flush(cx, &batch);
+	if(used < 0 || cx_keep(cx, cx->post + used, cx->post_len - used) < 0) {
+		return -1;
+	}
+
+	return ret;
+}
+
+static size_t
+ws13_header(unsigned char *h, int opcode, size_t len) {
+
+	int i;
+
+	h[0] = WS13_FIN | opcode;
+	if(len < 126) {
+		h[1] = (unsigned char)len;
+		return 2;
+	} else if(len < 65536) {
+		h[1] = 126;
+		h[2] = (unsigned char)(len >> 8);
+		h[3] = (unsigned char)len;
+		return 4;
+	}
+	h[1] = 127;
+	for(i = 0; i < 8; ++i) {
+		h[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+	}
+	return 10;
+}
+
+/**
+ * Wraps data in a RFC 6455 text frame.
+ */
+char *
+ws13_encode(const char *buf, size_t len, size_t *out_len) {
+
+	unsigned char header[WS13_HEADER_MAX];
+	size_t sz = ws13_header(header, WS13_TEXT, len);
+	char *tmp = rmalloc_in(MEM_BUFFERS, sz + len);
+
+	memcpy(tmp, header, sz);
+	memcpy(tmp + sz, buf, len);
+
+	*out_len = sz + len;
+	return tmp;
+}
+
+static z_stream *
+ws_deflater() {
+
+	if(!__deflate_ready) { /* raw deflate, negative window bits */
+		if(deflateInit2(&__deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					-MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return NULL;
+		}
+		__deflate_ready = 1;
+	}
+	return &__deflate;
+}
+
+static z_stream *
+ws_inflater() {
+
+	if(!__inflate_ready) {
+		if(inflateInit2(&__inflate, -MAX_WBITS) != Z_OK) {
+			return NULL;
+		}
+		__inflate_ready = 1;
+	}
+	return &__inflate;
+}
+
+/**
+ * Compress a message in a RFC 6455 frame with RSV1 set, from a fresh
+ * context. This is done once per message: the frame is then cached by
+ * the channel and sent to every compressing subscriber.
+ */
+char *
+ws13_encode_deflate(const char *buf, size_t len, size_t *out_len) {
+
+	unsigned char header[WS13_HEADER_MAX];
+	z_stream *z;
+	size_t bound, sz, hsz;
+	char *tmp, *out;
+
+	if(len < WS_DEFLATE_MIN || !(z = ws_deflater())) {
+		return ws13_encode(buf, len, out_len);
+	}
+	deflateReset(z);
+	bound = deflateBound(z, len) + 16; /* and the sync flush */
+	tmp = rmalloc_in(MEM_BUFFERS, WS13_HEADER_MAX + bound);
+	out = tmp + WS13_HEADER_MAX;
+
+	z->next_in = (Bytef *)buf;
+	z->avail_in = len;
+	z->next_out = (Bytef *)out;
+	z->avail_out = bound;
+	if(deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in || !z->avail_out) {
+		rfree(tmp);
+		return ws13_encode(buf, len, out_len);
+	}
+	sz = bound - z->avail_out;
+
+	/* the empty block at the end is implied (RFC 7692, 7.2.1) */
+	if(sz >= 4 && memcmp(out + sz - 4, "\x00\x00\xff\xff", 4) == 0) {
+		sz -= 4;
+	}
+	if(sz >= len) { /* not worth it */
+		rfree(tmp);
+		return ws13_encode(buf, len, out_len);
+	}
+
+	hsz = ws13_header(header, WS13_TEXT, sz);
+	header[0] |= WS13_RSV1;
+	memmove(tmp + hsz, out, sz);
+	memcpy(tmp, header, hsz);
+
+	*out_len = hsz + sz;
+	return tmp;
+}
+
+static int
+ws13_control(struct connection *cx, int opcode, const unsigned char *data, size_t len) {
+
+	unsigned char frame[2 + WS13_CONTROL_MAX];
+	size_t sz = ws13_header(frame, opcode, len);
+
+	memcpy(frame + sz, data, len);
+	return output_write(cx, (const char *)frame, sz + len);
+}
+
+/**
+ * Heartbeat: any frame received afterwards shows that the client is there.
+ */
+int
+ws13_ping(struct connection *cx) {
+
+	return ws13_control(cx, WS13_PING, (const unsigned char *)"", 0);
+}
+
+/**
+ * Close the connection with a status code, once it is sent.
+ */
+int
+ws13_close(struct connection *cx, int code) {
+
+	unsigned char status[2];
+
+	status[0] = (unsigned char)(code >> 8);
+	status[1] = (unsigned char)code;
+	ws13_control(cx, WS13_CLOSE, status, sizeof(status));
+
+	return -1;
+}
+
+#ifdef WS_SIMD
+static size_t
+ws_unmask_sse2(unsigned char *p, size_t len, uint32_t key) {
+
+	__m128i k = _mm_set1_epi32((int)key);
+	size_t i;
+
+	for(i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i *)(p + i));
+		_mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, k));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+ws_unmask_avx2(unsigned char *p, size_t len, uint32_t key) {
+
+	__m256i k = _mm256_set1_epi32((int)key);
+	size_t i;
+
+	for(i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((__m256i *)(p + i));
+		_mm256_storeu_si256((__m256i *)(p + i), _mm256_xor_si256(v, k));
+	}
+	return i;
+}
+#endif
+
+/**
+ * XOR a frame's payload with its 4-byte masking key, in place.
+ */
+void
+ws_unmask(unsigned char *data, size_t len, const unsigned char *key) {
+
+	uint32_t key32;
+	uint64_t key64, v;
+	size_t i = 0;
+
+	/* the key repeats every 4 bytes, so does it in wider words. */
+	memcpy(&key32, key, sizeof(key32));
+#ifdef WS_SIMD
+	if(len >= 64 && __builtin_cpu_supports("avx2")) {
+		i = ws_unmask_avx2(data, len, key32);
+	} else if(len >= 16) {
+		i = ws_unmask_sse2(data, len, key32);
+	}
+#endif
+	key64 = (uint64_t)key32 << 32 | key32;
+	for(; i + 8 <= len; i += 8) {
+		memcpy(&v, data + i, sizeof(v));
+		v ^= key64;
+		memcpy(data + i, &v, sizeof(v));
+	}
+	for(; i < len; ++i) {
+		data[i] ^= key[i & 3];
+	}
+}
+
+/**
+ * Inflate a compressed message and publish it.
+ */
+static int
+ws13_inflate(struct connection *cx, const unsigned char *data, size_t len) {
+
+	static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+	const unsigned char *in[2] = {data, tail};
+	size_t in_len[2] = {len, sizeof(tail)};
+	unsigned char out[16384];
+	z_stream *z = ws_inflater();
+	int ret = Z_OK, i;
+
+	if(!z) {
+		return ws13_close(cx, WS_CLOSE_PROTOCOL);
+	}
+	if(!__inflated) {
+		__inflated = evbuffer_new();
+	}
+	inflateReset(z); /* no context takeover */
+
+	for(i = 0; i < 2 && ret != Z_STREAM_END; ++i) {
+		z->next_in = (Bytef *)in[i];
+		z->avail_in = in_len[i];
+		do {
+			z->next_out = out;
+			z->avail_out = sizeof(out);
+			ret = inflate(z, Z_SYNC_FLUSH);
+			if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				evbuffer_drain(__inflated, EVBUFFER_LENGTH(__inflated));
+				return ws13_close(cx, WS_CLOSE_INVALID);
+			}
+			evbuffer_add(__inflated, out, sizeof(out) - z->avail_out);
+			if(EVBUFFER_LENGTH(__inflated) > CX_INPUT_MAX) {
+				evbuffer_drain(__inflated, EVBUFFER_LENGTH(__inflated));
+				return ws13_close(cx, WS_CLOSE_TOO_BIG);
+			}
+		} while(ret == Z_OK && (z->avail_in || !z->avail_out));
+	}
+
+	channel_write(cx->channel, (const char *)EVBUFFER_DATA(__inflated),
+			EVBUFFER_LENGTH(__inflated));
+	evbuffer_drain(__inflated, EVBUFFER_LENGTH(__inflated));
+	return 0;
+}
+
+/**
+ * A complete data frame: publish it, or keep it until the last fragment.
+ */
+static int
+ws13_data(struct connection *cx, struct ws_batch *batch, int fin, int opcode,
+		int compressed, const unsigned char *data, size_t len) {
+
+	struct ws_client *wsc = cx->wsc;
+	int ret = 0;
+
+	if((opcode == WS13_CONTINUATION) != wsc->fragmented) { /* out of order */
+		return ws13_close(cx, WS_CLOSE_PROTOCOL);
+	}
+	if(fin && !wsc->fragmented && !compressed) { /* common case, in one frame */
+		ws_batch_add(cx, batch, data, len);
+		return 0;
+	}
+
+	/* published on its own, after the messages before it */
+	ws_batch_flush(cx, batch);
+	if(fin && !wsc->fragmented) {
+		return ws13_inflate(cx, data, len);
+	}
+	if(!wsc->fragmented) { /* first fragment */
+		wsc->compressed = compressed;
+	}
+
+	if(!wsc->message) {
+		wsc->message = evbuffer_new();
+	}
+	if(EVBUFFER_LENGTH(wsc->message) + len > CX_INPUT_MAX) {
+		return ws13_close(cx, WS_CLOSE_TOO_BIG);
+	}
+	evbuffer_add(wsc->message, data, len);
+	wsc->fragmented = !fin;
+
+	if(fin) {
+		if(wsc->compressed) {
+			ret = ws13_inflate(cx, EVBUFFER_DATA(wsc->message),
+					EVBUFFER_LENGTH(wsc->message));
+		} else {
+			channel_write(cx->channel, (const char *)EVBUFFER_DATA(wsc->message),
+					EVBUFFER_LENGTH(wsc->message));
+		}
+		evbuffer_drain(wsc->message, EVBUFFER_LENGTH(wsc->message));
+	}
+	return ret;
+}
+
+/**
+ * Handle the complete frames received so far, in place.
+ * Returns the number of bytes used, or -1 when the connection must close.
+ */
+static int
+ws13_process(struct connection *cx, struct ws_batch *batch, unsigned char *data, size_t avail) {
+
+	struct ws_client *wsc = cx->wsc;
+	unsigned char *start = data, *mask, *payload;
+	size_t header;
+	uint64_t len;
+	int fin, opcode, rsv, i;
+
+	for(; avail >= 2; data += header + 4 + len, avail -= header + 4 + len) {
+		fin = data[0] & WS13_FIN;
+		opcode = data[0] & 0x0f;
+		rsv = data[0] & 0x70;
+
+		/* RSV1 marks a compressed message, on its first frame only;
+		 * clients mask their frames. */
+		if((rsv && (rsv != WS13_RSV1 || !wsc->deflate
+				|| opcode == WS13_CONTINUATION || (opcode & 0x8)))
+				|| !(data[1] & WS13_MASK)) {
+			return ws13_close(cx, WS_CLOSE_PROTOCOL);
+		}
+
+		len = data[1] & 0x7f;
+		header = 2;
+		if(len == 126) {
+			if(avail < 4) {
+				break;
+			}
+			len = (uint64_t)data[2] << 8 | data[3];
+			header = 4;
+		} else if(len == 127) {
+			if(avail < 10) {
+				break;
+			}
+			for(len = 0, i = 0; i < 8; ++i) {
+				len = len << 8 | data[2 + i];
+			}
+			header = 10;
+		}
+		if(len > WS13_FRAME_MAX) {
+			return ws13_close(cx, WS_CLOSE_TOO_BIG);
+		}
+		if(avail < header + 4 + len) { /* wait for the rest */
+			break;
+		}
+		mask = data + header;
+		payload = mask + 4;
+		ws_unmask(payload, len, mask);
+
+		if(opcode & 0x8) { /* control frames are short and never fragmented */
+			if(!fin || len > WS13_CONTROL_MAX) {
+				return ws13_close(cx, WS_CLOSE_PROTOCOL);
+			}
+			switch(opcode) {
+				case WS13_CLOSE:
+					return ws13_close(cx, len >= 2
+						? (payload[0] << 8 | payload[1]) : WS_CLOSE_NORMAL);
+				case WS13_PING:
+					ws13_control(cx, WS13_PONG, payload, len);
+					break;
+				case WS13_PONG:
+					break;
+				default:
+					return ws13_close(cx, WS_CLOSE_PROTOCOL);
+			}
+		} else if(opcode == WS13_CONTINUATION || opcode == WS13_TEXT
+				|| opcode == WS13_BINARY) {
+			if(ws13_data(cx, batch, fin, opcode, rsv != 0, payload, len) != 0) {
+				return -1;
+			}
+		} else {
+			return ws13_close(cx, WS_CLOSE_PROTOCOL);
+		}
+	}
+	return (int)(data - start);
+}
@@ -8,6 +8,18 @@ struct channel;
 struct channel_user;
 struct evbuffer;
 
+typedef enum {
+	WS_HIXIE76 = 0,	/* 0x00 data 0xff frames */
+	WS_RFC6455	/* length-prefixed frames */
+} ws_version;
+
+/* RFC 6455 close codes */
+#define WS_CLOSE_NORMAL		1000
+#define WS_CLOSE_GOING_AWAY	1001
+#define WS_CLOSE_PROTOCOL	1002
+#define WS_CLOSE_INVALID	1007
+#define WS_CLOSE_TOO_BIG	1009
+
 struct ws_client {
 	struct event ev;
 	struct event_base *base;
@@ -15,14 +27,44 @@ struct ws_client {
 	struct channel *chan; /* current channel the user is connected on */
 	struct channel_user *cu; /* channel user using ws:// */
 
-	struct evbuffer *buffer; /* data read so far */
+	ws_version version;
+
+	/* fragments of the message being received (RFC 6455) */
+	struct evbuffer *message;
+	int fragmented;
+	int compressed;
+
+	int deflate; /* permessage-deflate, without context takeover */
+
+	int ping_pending; /* heartbeat sent, nothing received since */
 };
 
 int
 ws_start(struct connection *cx);
 
+void
+ws_client_new(struct connection *cx, ws_version version);
+
+char *
+ws_encode(const char *buf, size_t len, size_t *out_len);
+
 int
-ws_write(struct connection *cx, const char *buf, size_t len);
+ws13_start(struct connection *cx);
+
+char *
+ws13_encode(const char *buf, size_t len, size_t *out_len);
+
+int
+ws13_ping(struct connection *cx);
+
+int
+ws13_close(struct connection *cx, int code);
+
+char *
+ws13_encode_deflate(const char *buf, size_t len, size_t *out_len);
+
+void
+ws_unmask(unsigned char *data, size_t len, const unsigned char *key);
 
 void
 ws_close(struct connection *cx);
@@ -0,0 +1,187 @@
+#include <string.h>
+#include <event.h>
+
+#include "wheel.h"
+#include "history.h"
+
+static void
+on_wheel_tick(int fd, short event, void *ptr);
+
+static void
+wheel_link(struct wheel_timer **list, struct wheel_timer *t) {
+
+	t->list = list;
+	t->prev = NULL;
+	t->next = *list;
+	if(*list) {
+		(*list)->prev = t;
+	}
+	*list = t;
+}
+
+static void
+wheel_unlink(struct wheel_timer *t) {
+
+	if(t->prev) {
+		t->prev->next = t->next;
+	} else {
+		*t->list = t->next;
+	}
+	if(t->next) {
+		t->next->prev = t->prev;
+	}
+	t->list = NULL;
+	t->prev = t->next = NULL;
+}
+
+static void
+wheel_arm(struct wheel *w) {
+
+	struct timeval tv = {0, WHEEL_TICK * 1000};
+
+	if(w->armed) {
+		return;
+	}
+	evtimer_set(&w->ev, on_wheel_tick, w);
+	event_base_set(w->base, &w->ev);
+	evtimer_add(&w->ev, &tv);
+	w->armed = 1;
+}
+
+void
+wheel_init(struct wheel *w, struct event_base *base) {
+
+	memset(w, 0, sizeof(*w));
+	w->base = base;
+}
+
+void
+wheel_timer_init(struct wheel_timer *t, wheel_function fun, void *ptr) {
+
+	memset(t, 0, sizeof(*t));
+	t->fun = fun;
+	t->ptr = ptr;
+}
+
+/**
+ * Put a timer in the level covering the time it has left.
+ */
+static void
+wheel_place(struct wheel *w, struct wheel_timer *t) {
+
+	unsigned long left = t->expires - w->now;
+	int level;
+
+	for(level = 0; level < WHEEL_LEVELS - 1
+			&& left >= 1UL << (WHEEL_BITS * (level + 1)); ++level);
+
+	if(left >= 1UL << (WHEEL_BITS * WHEEL_LEVELS)) { /* too far */
+		t->expires = w->now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+	wheel_link(&w->slots[level][(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)], t);
+}
+
+/**
+ * Schedule a timer in `ms' milliseconds, rounded up to the next tick.
+ * A timer which is already scheduled is moved.
+ */
+void
+wheel_add(struct wheel *w, struct wheel_timer *t, unsigned long ms) {
+
+	unsigned long ticks = (ms + WHEEL_TICK - 1) / WHEEL_TICK;
+
+	if(t->wheel) {
+		wheel_del(t);
+	}
+	if(!w->count && !w->armed) { /* was asleep: time starts again now */
+		w->last = history_clock();
+	}
+
+	/* `now' is the next tick to run */
+	t->expires = w->now + (ticks ? ticks - 1 : 0);
+	wheel_place(w, t);
+	t->wheel = w;
+	w->count++;
+
+	wheel_arm(w);
+}
+
+void
+wheel_del(struct wheel_timer *t) {
+
+	if(!t->wheel) {
+		return;
+	}
+	t->wheel->count--;
+	t->wheel = NULL;
+	wheel_unlink(t);
+}
+
+/**
+ * Move the timers of the current slot of a level down, now that the
+ * levels below have turned. Returns the index of that slot.
+ */
+static unsigned int
+wheel_cascade(struct wheel *w, int level) {
+
+	unsigned int i = (w->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	struct wheel_timer *t, *next;
+
+	t = w->slots[level][i];
+	w->slots[level][i] = NULL;
+	for(; t; t = next) {
+		next = t->next;
+		wheel_place(w, t);
+	}
+	return i;
+}
+
+/**
+ * Run a tick, and the timers which expire with it.
+ */
+static void
+wheel_tick(struct wheel *w) {
+
+	unsigned int i = w->now & (WHEEL_SIZE - 1);
+	struct wheel_timer *t, *next;
+	int level;
+
+	/* level 0 turned: bring the next timers down, further up if needed. */
+	if(!i) {
+		for(level = 1; level < WHEEL_LEVELS && !wheel_cascade(w, level); ++level);
+	}
+	w->now++;
+
+	for(t = w->slots[0][i]; t; t = next) {
+		next = t->next;
+		wheel_unlink(t);
+		wheel_link(&w->due, t);
+	}
+
+	/* callbacks can add and remove any timer, expired ones included. */
+	while((t = w->due)) {
+		wheel_del(t);
+		t->fun(t);
+	}
+}
+
+static void
+on_wheel_tick(int fd, short event, void *ptr) {
+	(void)fd;
+	(void)event;
+
+	struct wheel *w = ptr;
+	unsigned long long now = history_clock();
+
+	w->armed = 0;
+
+	/* catch up if the loop was busy */
+	while(w->count && now >= w->last + WHEEL_TICK) {
+		w->last += WHEEL_TICK;
+		wheel_tick(w);
+	}
+
+	if(w->count) {
+		wheel_arm(w);
+	}
+}
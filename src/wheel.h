@@ -0,0 +1,64 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <event.h>
+
+/*
+ * Hierarchical timing wheel, one per worker. Level 0 has a slot per tick,
+ * level n a slot per WHEEL_SIZE^n ticks: a timer goes in the level covering
+ * its delay, and moves down a level each time the level below has turned.
+ * Adding or removing a timer is O(1), a tick runs one slot of level 0 and
+ * once every WHEEL_SIZE ticks redistributes a slot of the level above.
+ * Delays beyond the last level are shortened to fit in it.
+ *
+ * The wheel has a single libevent timer, which runs while it has timers.
+ * Timers are embedded in the objects they belong to.
+ */
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)	/* slots per level */
+#define WHEEL_LEVELS	4			/* up to 19 days */
+#define WHEEL_TICK	100			/* ms */
+
+struct wheel;
+struct wheel_timer;
+
+typedef void (*wheel_function)(struct wheel_timer *t);
+
+struct wheel_timer {
+	wheel_function fun;
+	void *ptr;
+
+	unsigned long expires;		/* tick */
+	struct wheel *wheel;		/* NULL when not scheduled */
+	struct wheel_timer **list;	/* slot or list of expired timers */
+	struct wheel_timer *prev;
+	struct wheel_timer *next;
+};
+
+struct wheel {
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+	struct wheel_timer *due;	/* expired, being run */
+
+	unsigned long now;		/* next tick to run */
+	unsigned long long last;	/* history_clock(), when `now' was reached */
+	unsigned long count;		/* scheduled timers */
+
+	struct event_base *base;
+	struct event ev;
+	int armed;
+};
+
+void
+wheel_init(struct wheel *w, struct event_base *base);
+
+void
+wheel_timer_init(struct wheel_timer *t, wheel_function fun, void *ptr);
+
+void
+wheel_add(struct wheel *w, struct wheel_timer *t, unsigned long ms);
+
+void
+wheel_del(struct wheel_timer *t);
+
+#endif /* WHEEL_H */
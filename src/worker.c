@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <event.h>
+
+#include "worker.h"
+#include "server.h"
+#include "socket.h"
+#include "channel.h"
+#include "channel_table.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "upgrade.h"
+#include "mem.h"
+
+#define CHANNEL_CLEANUP_TIMER	1
+
+/* commands per sender ring */
+#define WORKER_RING_SIZE	1024
+
+/* max number of commands run from a single ring per wake-up */
+#define WORKER_BATCH_SIZE	256
+
+static struct worker *__workers = NULL;
+static int __worker_count = 0;
+
+/* worker running in the current thread */
+static __thread struct worker *__worker_current = NULL;
+
+static void
+on_worker_cmd(int fd, short event, void *ptr);
+
+static void
+on_worker_retry(int fd, short event, void *ptr);
+
+/**
+ * Creates the workers, each one with its own event base and listening socket.
+ */
+int
+worker_init(int count, const char *ip, short port) {
+
+	int i, j;
+
+	if(count < 1) {
+		count = 1;
+	}
+
+	__workers = rcalloc(count, sizeof(struct worker));
+	__worker_count = count;
+
+	for(i = 0; i < count; ++i) {
+		struct worker *w = &__workers[i];
+
+		w->id = i;
+		w->base = event_base_new();
+
+		/* every worker accepts on its own socket, the kernel spreads
+		 * the incoming connections thanks to SO_REUSEPORT. */
+		if((w->fd = upgrade_take(UPGRADE_HTTP, i)) == -1
+			&& (w->fd = socket_setup(ip, port)) == -1) {
+			return -1;
+		}
+
+		if((w->efd = eventfd(0, EFD_NONBLOCK)) == -1) {
+			syslog(LOG_ERR, "eventfd error: %m\n");
+			return -1;
+		}
+
+		/* one ring per sender, none from ourselves. */
+		w->inbox = rcalloc(count, sizeof(struct ring *));
+		for(j = 0; j < count; ++j) {
+			if(j != i) {
+				w->inbox[j] = ring_new(WORKER_RING_SIZE, sizeof(struct worker_cmd));
+			}
+		}
+		w->backlog = rcalloc(count, sizeof(struct worker_backlog));
+		evtimer_set(&w->ev_retry, on_worker_retry, w);
+		event_base_set(w->base, &w->ev_retry);
+
+		event_set(&w->ev_accept, w->fd, EV_READ | EV_PERSIST, on_possible_accept, w->base);
+		event_base_set(w->base, &w->ev_accept);
+		event_add(&w->ev_accept, NULL);
+
+		event_set(&w->ev_cmd, w->efd, EV_READ | EV_PERSIST, on_worker_cmd, w);
+		event_base_set(w->base, &w->ev_cmd);
+		event_add(&w->ev_cmd, NULL);
+
+		w->ct.base = w->base;
+		w->ct.tv.tv_sec = CHANNEL_CLEANUP_TIMER;
+		w->ct.tv.tv_usec = 0;
+		cleanup_reset(&w->ct);
+
+		wheel_init(&w->wheel, w->base);
+	}
+
+	return 0;
+}
+
+/**
+ * Runs the event loop of a worker, in the calling thread.
+ */
+void
+worker_run(struct worker *w) {
+
+	__worker_current = w;
+
+	/* the channels owned by this worker */
+	channel_init(w->base);
+	if(journal_open(w) != 0) {
+		return;
+	}
+	snapshot_load(w);
+	upgrade_adopt(w);
+
+	event_base_dispatch(w->base);
+}
+
+struct worker *
+worker_get(int id) {
+	return &__workers[id];
+}
+
+int
+worker_count() {
+	return __worker_count;
+}
+
+struct worker *
+worker_current() {
+	return __worker_current;
+}
+
+/**
+ * Find the worker owning a channel.
+ */
+struct worker *
+worker_owner(const char *name, size_t name_len) {
+
+	uint32_t h;
+
+	if(__worker_count == 1) {
+		return &__workers[0];
+	}
+
+	/* the channel table uses the low bits of the hash, use the high ones. */
+	h = channel_table_hash(name, name_len);
+
+	return &__workers[((uint64_t)h * __worker_count) >> 32];
+}
+
+/**
+ * Wake a worker up, unless it has already been signaled since its last drain.
+ */
+static void
+worker_notify(struct worker *w) {
+
+	uint64_t one = 1;
+	int ret;
+
+	if(__atomic_exchange_n(&w->notified, 1, __ATOMIC_SEQ_CST) == 0) {
+		ret = write(w->efd, &one, sizeof(one));
+		(void)ret;
+	}
+}
+
+/**
+ * Move commands from our backlog to the inbox of `w', in order.
+ * Returns the number of commands still waiting.
+ */
+static int
+worker_flush_backlog(struct worker *self, struct worker *w) {
+
+	struct worker_backlog *bl = &self->backlog[w->id];
+	struct ring *r = w->inbox[self->id];
+	int sent = 0;
+
+	while(bl->head && ring_push(r, &bl->head->cmd) == 0) {
+		struct worker_pending *next = bl->head->next;
+		rfree(bl->head);
+		bl->head = next;
+		self->backlog_count--;
+		sent = 1;
+	}
+	if(!bl->head) {
+		bl->tail = NULL;
+	}
+	if(sent) {
+		worker_notify(w);
+	}
+	return bl->head ? 1 : 0;
+}
+
+static void
+worker_retry_reset(struct worker *self) {
+
+	struct timeval tv = {0, 1000};
+	evtimer_add(&self->ev_retry, &tv);
+}
+
+/**
+ * Called while some of our commands are waiting for room in a full ring.
+ */
+static void
+on_worker_retry(int fd, short event, void *ptr) {
+	(void)fd;
+	(void)event;
+
+	struct worker *self = ptr;
+	int i, waiting = 0;
+
+	for(i = 0; i < __worker_count; ++i) {
+		if(self->backlog[i].head) {
+			waiting |= worker_flush_backlog(self, &__workers[i]);
+		}
+	}
+	if(waiting) {
+		worker_retry_reset(self);
+	}
+}
+
+/**
+ * Send a command to another worker, through the ring we own in its inbox.
+ * This never blocks: if the ring is full, the command waits in our backlog.
+ */
+static void
+worker_send(struct worker *w, struct worker_cmd *cmd) {
+
+	struct worker *self = __worker_current;
+	struct worker_backlog *bl = &self->backlog[w->id];
+	struct worker_pending *p;
+
+	/* keep commands ordered behind those already waiting */
+	if(!bl->head && ring_push(w->inbox[self->id], cmd) == 0) {
+		worker_notify(w);
+		return;
+	}
+
+	p = rmalloc(sizeof(struct worker_pending));
+	p->cmd = *cmd;
+	p->next = NULL;
+	if(bl->tail) {
+		bl->tail->next = p;
+	} else {
+		bl->head = p;
+	}
+	bl->tail = p;
+
+	if(self->backlog_count++ == 0) {
+		worker_retry_reset(self);
+	}
+	worker_flush_backlog(self, w);
+}
+
+/**
+ * Give a connection to another worker. The caller must not touch it anymore.
+ */
+void
+worker_handoff(struct worker *w, struct connection *cx) {
+
+	struct worker_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = CMD_DISPATCH;
+	cmd.cx = cx;
+
+	worker_send(w, &cmd);
+}
+
+/**
+ * Publish a message on a channel, from any worker.
+ */
+void
+worker_publish(const char *name, size_t name_len, const char *data, size_t data_len) {
+
+	struct worker *w = worker_owner(name, name_len);
+	struct worker_cmd cmd;
+	struct channel *channel;
+
+	if(w == __worker_current) { /* local channel */
+		if((channel = channel_find(name, name_len))) {
+			channel_write(channel, data, data_len);
+		}
+		return;
+	}
+
+	/* copy the message, it is going to be written by the owner. */
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = CMD_PUBLISH;
+	cmd.name_len = (unsigned int)name_len;
+	cmd.data_len = (unsigned int)data_len;
+	cmd.buffer = rmalloc_in(MEM_BUFFERS, name_len + 1 + data_len);
+	memcpy(cmd.buffer, name, name_len);
+	cmd.buffer[name_len] = 0;
+	memcpy(cmd.buffer + name_len + 1, data, data_len);
+
+	worker_send(w, &cmd);
+}
+
+static void
+worker_exec(struct worker *w, struct worker_cmd *cmd) {
+
+	struct channel *channel;
+
+	switch(cmd->type) {
+		case CMD_DISPATCH:
+			/* the connection now lives in our event base. */
+			cmd->cx->base = w->base;
+			server_dispatch(cmd->cx);
+			break;
+
+		case CMD_PUBLISH:
+			if((channel = channel_find(cmd->buffer, cmd->name_len))) {
+				channel_write(channel, cmd->buffer + cmd->name_len + 1,
+						cmd->data_len);
+			}
+			rfree(cmd->buffer);
+			break;
+
+		case CMD_SNAPSHOT:
+			snapshot_write(w, 1);
+			break;
+
+		case CMD_STOP:
+			snapshot_write(w, 1);
+			event_base_loopexit(w->base, NULL);
+			break;
+
+		case CMD_UPGRADE:
+			upgrade_handoff(w);
+			break;
+	}
+}
+
+/**
+ * Run a command without arguments in every worker, starting with the others.
+ */
+void
+worker_broadcast(worker_cmd_type type) {
+
+	struct worker_cmd cmd;
+	int i;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = type;
+	for(i = 0; i < __worker_count; ++i) {
+		if(&__workers[i] != __worker_current) {
+			worker_send(&__workers[i], &cmd);
+		}
+	}
+	worker_exec(__worker_current, &cmd);
+}
+
+/**
+ * Called when other workers have sent us commands.
+ */
+static void
+on_worker_cmd(int fd, short event, void *ptr) {
+	(void)event;
+
+	struct worker *w = ptr;
+	struct worker_cmd cmd;
+	uint64_t n;
+	int i, count, ret, more = 0;
+
+	ret = read(fd, &n, sizeof(n));
+	(void)ret;
+
+	/* re-arm notifications before looking at the rings,
+	 * so that no command can be left behind unsignaled. */
+	__atomic_store_n(&w->notified, 0, __ATOMIC_SEQ_CST);
+
+	for(i = 0; i < __worker_count; ++i) {
+		if(!w->inbox[i]) {
+			continue;
+		}
+		/* bounded batch per sender, to keep latency fair. */
+		for(count = 0; count < WORKER_BATCH_SIZE; ++count) {
+			if(ring_pop(w->inbox[i], &cmd) != 0) {
+				break;
+			}
+			worker_exec(w, &cmd);
+		}
+		if(count == WORKER_BATCH_SIZE) {
+			more = 1;
+		}
+	}
+
+	if(more) { /* come back after the other events. */
+		worker_notify(w);
+	}
+}
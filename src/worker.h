@@ -0,0 +1,100 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <event.h>
+
+#include "server.h"
+#include "ring.h"
+#include "wheel.h"
+
+struct connection;
+
+typedef enum {
+	CMD_DISPATCH = 0,	/* take over a connection and dispatch it */
+	CMD_PUBLISH,		/* write a message to a local channel */
+	CMD_SNAPSHOT,		/* save the local channels */
+	CMD_STOP,		/* save the local channels and leave the event loop */
+	CMD_UPGRADE		/* hand the local channels over to a new server, and leave */
+} worker_cmd_type;
+
+/* copied by value through the rings */
+struct worker_cmd {
+	worker_cmd_type type;
+
+	struct connection *cx;
+
+	/* channel name, zero-terminated, followed by the data. */
+	char *buffer;
+	unsigned int name_len;
+	unsigned int data_len;
+};
+
+/* commands which did not fit in a full ring, kept by the sender. */
+struct worker_pending {
+	struct worker_cmd cmd;
+	struct worker_pending *next;
+};
+
+struct worker_backlog {
+	struct worker_pending *head;
+	struct worker_pending *tail;
+};
+
+/**
+ * An event loop, running in its own thread.
+ * Each channel is owned by a single worker, chosen from the channel name.
+ */
+struct worker {
+	int id;
+	pthread_t thread;
+
+	struct event_base *base;
+
+	int fd; /* listening socket, shared with the other workers */
+	struct event ev_accept;
+
+	struct cleanup_timer ct;
+	struct wheel wheel; /* heartbeats of the connections */
+
+	/* commands sent by the other workers: inbox[i] is written by worker i
+	 * only, and efd is signaled once until we drain the rings. */
+	struct ring **inbox;
+	int efd;
+	int notified;
+	struct event ev_cmd;
+
+	/* backlog[i]: commands waiting for room in worker i's inbox. */
+	struct worker_backlog *backlog;
+	int backlog_count;
+	struct event ev_retry;
+};
+
+int
+worker_init(int count, const char *ip, short port);
+
+void
+worker_run(struct worker *w);
+
+struct worker *
+worker_get(int id);
+
+int
+worker_count();
+
+struct worker *
+worker_current();
+
+struct worker *
+worker_owner(const char *name, size_t name_len);
+
+void
+worker_handoff(struct worker *w, struct connection *cx);
+
+void
+worker_publish(const char *name, size_t name_len, const char *data, size_t data_len);
+
+void
+worker_broadcast(worker_cmd_type type);
+
+#endif /* WORKER_H */
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/**
+ * Checks that a slow subscriber gets a well-formed stream when messages
+ * are coalesced: the server must never drop a message it has started to
+ * write. The channel must have the coalesce policy, e.g. with
+ *
+ *	channel coalesce- slow_consumer coalesce
+ *
+ * in river.conf. The subscriber doesn't read while large messages are
+ * published, so that its socket fills up in the middle of a chunk; then it
+ * reads everything and parses the chunked encoding.
+ */
+
+static int
+tcp_connect(const char *host, short port, int rcvbuf) {
+
+	struct sockaddr_in addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(rcvbuf) { /* before connecting, for the window to stay small */
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(host);
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+static void
+send_all(int fd, const char *data, size_t len) {
+
+	ssize_t ret;
+
+	for(; len; data += ret, len -= ret) {
+		if((ret = write(fd, data, len)) <= 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void
+publish(const char *host, short port, const char *channel, int seq, size_t size) {
+
+	char header[256], *body, reply[512];
+	int fd = tcp_connect(host, port, 0), hlen, blen;
+
+	body = malloc(size + 64);
+	blen = sprintf(body, "name=%s&data=%d-", channel, seq);
+	memset(body + blen, 'x', size);
+	blen += size;
+
+	hlen = sprintf(header, "POST /publish HTTP/1.0\r\nContent-Length: %d\r\n\r\n", blen);
+	send_all(fd, header, hlen);
+	send_all(fd, body, blen);
+	if(read(fd, reply, sizeof(reply)) <= 0) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	free(body);
+}
+
+int
+main(int argc, char *argv[]) {
+
+	const char *host = "127.0.0.1", *channel = "coalesce-test";
+	short port = 1234;
+	int count = 200, size = 100000, opt, fd, messages = 0, last = -1, i;
+	char request[256], *stream, *p, *end, *data;
+	size_t len = 0, capacity = 1 << 20;
+	ssize_t ret;
+	unsigned long chunk;
+
+	while ((opt = getopt(argc, argv, "h:p:c:n:s:")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = (short)atoi(optarg);
+				break;
+			case 'c':
+				channel = optarg;
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+			default: /* '?' */
+				fprintf(stderr, "Usage: %s [-h host] [-p port] [-c channel] "
+						"[-n messages] [-s size]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	fd = tcp_connect(host, port, 4096);
+	sprintf(request, "GET /subscribe?name=%s HTTP/1.0\r\n\r\n", channel);
+	send_all(fd, request, strlen(request));
+	usleep(200000);
+
+	for(i = 0; i < count; ++i) {
+		publish(host, port, channel, i, size);
+	}
+
+	/* read what is left, until the server has nothing more to send. */
+	stream = malloc(capacity);
+	struct timeval tv = {1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while((ret = read(fd, stream + len, capacity - len)) > 0) {
+		len += ret;
+		if(len == capacity) {
+			stream = realloc(stream, capacity *= 2);
+		}
+	}
+
+	/* headers, then chunks of one message each */
+	if(!(p = strstr(stream, "\r\n\r\n"))) {
+		fprintf(stderr, "FAIL: no headers\n");
+		return EXIT_FAILURE;
+	}
+	p += 4;
+	end = stream + len;
+	while(p < end) {
+		chunk = strtoul(p, &data, 16);
+		if(data + 2 > end || data[0] != '\r' || data[1] != '\n') {
+			fprintf(stderr, "FAIL: bad chunk header at %ld\n", (long)(p - stream));
+			return EXIT_FAILURE;
+		}
+		data += 2;
+		if(data + chunk + 2 > end) {
+			break; /* cut by the timeout */
+		}
+		if(data[chunk] != '\r' || data[chunk + 1] != '\n'
+				|| strncmp(data, "[\"msg\"", 6) != 0
+				|| data[chunk - 1] != ']') {
+			fprintf(stderr, "FAIL: bad message at %ld\n", (long)(data - stream));
+			return EXIT_FAILURE;
+		}
+		/* messages can be missing, never out of order */
+		if(!(p = strstr(data, "\"data\": \"")) || atoi(p + 9) <= last) {
+			fprintf(stderr, "FAIL: message out of order at %ld\n", (long)(data - stream));
+			return EXIT_FAILURE;
+		}
+		last = atoi(p + 9);
+		messages++;
+		p = data + chunk + 2;
+	}
+
+	printf("OK: %d messages of %d read, the last one was #%d (%lu bytes)\n",
+			messages, count, last, (unsigned long)len);
+	return EXIT_SUCCESS;
+}
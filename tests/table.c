@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "channel.h"
+#include "channel_table.h"
+#include "dict.h"
+
+/**
+ * Compares the channel table with dict.c, on the operations
+ * done by the server: adding channels and finding them by name.
+ */
+
+static double
+elapsed(struct timespec *t0) {
+
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void
+report(const char *what, int n, double sec) {
+	printf("%-26s %10.2f ns/op\n", what, sec * 1e9 / n);
+}
+
+int
+main(int argc, char *argv[]) {
+
+	int count = 1000000, lookups = 5000000;
+	int i, opt, *order;
+	struct channel *channels;
+	struct channel_table *t;
+	dict *d;
+	struct timespec t0;
+	char name[32];
+	size_t found = 0;
+
+	while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+		switch (opt) {
+			case 'c':
+				count = atoi(optarg);
+				break;
+			case 'n':
+				lookups = atoi(optarg);
+				break;
+			default: /* '?' */
+				fprintf(stderr, "Usage: %s [-c channels] [-n lookups]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	/* channel names and a random lookup order, shared by both tables */
+	channels = calloc(count, sizeof(struct channel));
+	for(i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "chan-%d", i);
+		channels[i].name = strdup(name);
+		channels[i].name_len = strlen(name);
+	}
+	order = calloc(lookups, sizeof(int));
+	for(i = 0; i < lookups; ++i) {
+		order[i] = rand() % count;
+	}
+	printf("%d channels, %d lookups\n", count, lookups);
+
+	/* dict.c */
+	d = dictCreate(&dictTypeCopyNoneFreeNone, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < count; ++i) {
+		dictAdd(d, channels[i].name, &channels[i], 0);
+	}
+	report("dict: add", count, elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < lookups; ++i) {
+		found += dictFind(d, channels[order[i]].name) != NULL;
+	}
+	report("dict: find", lookups, elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < lookups; ++i) {
+		snprintf(name, sizeof(name), "none-%d", order[i]);
+		found += dictFind(d, name) != NULL;
+	}
+	report("dict: find (missing)", lookups, elapsed(&t0));
+
+	/* channel table */
+	t = channel_table_new();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < count; ++i) {
+		channel_table_add(t, &channels[i]);
+	}
+	report("channel_table: add", count, elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < lookups; ++i) {
+		struct channel *c = &channels[order[i]];
+		found += channel_table_find(t, c->name, c->name_len) != NULL;
+	}
+	report("channel_table: find", lookups, elapsed(&t0));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < lookups; ++i) {
+		int len = snprintf(name, sizeof(name), "none-%d", order[i]);
+		found += channel_table_find(t, name, len) != NULL;
+	}
+	report("channel_table: find (missing)", lookups, elapsed(&t0));
+
+	if(found != 2 * (size_t)lookups || channel_table_size(t) != (size_t)count) {
+		fprintf(stderr, "lookup error: found %zu of %d\n", found, 2 * lookups);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}